@@ -1,8 +1,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #include "bson.h"
+#include "allocator.h"
 
 void *defmalloc(size_t size, void *ud)                 { return malloc(size);           }
 void *defcalloc(size_t nummemb, size_t size, void *ud) { return calloc(nummemb, size);  }
@@ -26,7 +28,7 @@ bsonenum bson_set_allocator(const bsonmem *m) {
 	m->calloc == NULL  ||
 	m->realloc == NULL ||
 	m->strdup == NULL  ||
-	m->free
+	m->free == NULL
     ) return BSON_NULL_PTR;
     mem = *m;
     return BSON_SUCCESS;
@@ -37,3 +39,118 @@ void *bsoncalloc(size_t nummemb, size_t size) { return mem.calloc(nummemb, size,
 void *bsonrealloc(void *ptr, size_t size)     { return mem.realloc(ptr, size, mem.userdata);    }
 char *bsonstrdup(const char *str)             { return mem.strdup(str, mem.userdata);           }
 void  bsonfree(void *ptr)                     {        mem.free(ptr, mem.userdata);             }
+
+/* ARENA */
+
+#define BLOCK_FIRST   4096
+#define BLOCK_LIMIT   (1 << 20)
+#define TEMP_ALIGN      16
+
+struct _s_bsonblock {
+    bsonblock *next;
+    uint64_t   size;
+};
+
+void bsonarena_init(bsonarena *a) {
+    memset(a, 0, sizeof(bsonarena));
+}
+
+void bsonarena_fixed(bsonarena *a, void *buffer, uint64_t size) {
+    memset(a, 0, sizeof(bsonarena));
+    a->base  = buffer;
+    a->size  = size;
+    a->top   = ((uintptr_t)(a->base) + size) % TEMP_ALIGN;
+    a->top   = size - a->top;
+    a->fixed = 1;
+}
+
+static int arena_grow(bsonarena *a, uint64_t size, uint64_t align) {
+    uint64_t blocksize = a->blocks == NULL ? BLOCK_FIRST : a->blocks->size * 2;
+    if(blocksize > BLOCK_LIMIT)
+	blocksize = BLOCK_LIMIT;
+    if(blocksize < size + align + sizeof(bsonblock))
+	blocksize = size + align + sizeof(bsonblock);
+    bsonblock *b = bsonmalloc(blocksize);
+    if(b == NULL)
+	return 0;
+    a->heapallocs++;
+    a->heapbytes += blocksize;
+    b->next   = a->blocks;
+    b->size   = blocksize;
+    a->blocks = b;
+    a->base   = (char *)(b);
+    a->size   = blocksize;
+    a->used   = sizeof(bsonblock);
+    a->top    = blocksize;
+    return 1;
+}
+
+void *bsonarena_alloc(bsonarena *a, uint64_t size, uint64_t align) {
+    uint64_t at = ((uintptr_t)(a->base) + a->used + align - 1) & ~(uintptr_t)(align - 1);
+    at -= (uintptr_t)(a->base);
+    if(a->base == NULL || at + size > a->top) {
+	if(a->fixed || !arena_grow(a, size, align))
+	    return NULL;
+	return bsonarena_alloc(a, size, align);
+    }
+    a->used = at + size;
+    a->allocs++;
+    a->allocbytes += size;
+    return a->base + at;
+}
+
+void *bsonarena_calloc(bsonarena *a, uint64_t size, uint64_t align) {
+    void *ptr = bsonarena_alloc(a, size, align);
+    if(ptr != NULL)
+	memset(ptr, 0, size);
+    return ptr;
+}
+
+char *bsonarena_strdup(bsonarena *a, const char *str) {
+    uint64_t len = strlen(str) + 1;
+    char *ptr = bsonarena_alloc(a, len, 1);
+    if(ptr != NULL)
+	memcpy(ptr, str, len);
+    return ptr;
+}
+
+/* Gives back the tail of ptr, as long as it was the last allocation */
+void bsonarena_trim(bsonarena *a, void *ptr, uint64_t size, uint64_t newsize) {
+    if((char *)(ptr) + size == a->base + a->used && newsize <= size) {
+	a->used -= size - newsize;
+	a->allocbytes -= size - newsize;
+    }
+}
+
+void *bsonarena_temp(bsonarena *a, uint64_t size) {
+    if(!a->fixed) {
+	a->heapallocs++;
+	a->heapbytes += size;
+	return bsonmalloc(size);
+    }
+    size = (size + TEMP_ALIGN - 1) & ~(uint64_t)(TEMP_ALIGN - 1);
+    if(a->used + size > a->top)
+	return NULL;
+    a->top -= size;
+    return a->base + a->top;
+}
+
+/* In a fixed buffer this also drops every temporary taken after ptr */
+void bsonarena_untemp(bsonarena *a, void *ptr, uint64_t size) {
+    if(!a->fixed) {
+	bsonfree(ptr);
+	return;
+    }
+    size = (size + TEMP_ALIGN - 1) & ~(uint64_t)(TEMP_ALIGN - 1);
+    a->top = (uint64_t)((char *)(ptr) - a->base) + size;
+}
+
+void bsonarena_release(bsonarena *a) {
+    bsonblock *b = a->blocks, *tmp;
+    while(b != NULL) {
+	tmp = b->next;
+	bsonfree(b);
+	b = tmp;
+    }
+    memset(a, 0, sizeof(bsonarena));
+}
@@ -2,11 +2,41 @@
 #define _BSON_ALLOCATOR_H_
 
 #include <stddef.h>
+#include <stdint.h>
 
 void *bsonmalloc(size_t size);
 void *bsoncalloc(size_t nummemb, size_t size);
 void *bsonrealloc(void *ptr, size_t size);
-void *bsonstrdup(const char *str);
+char *bsonstrdup(const char *str);
 void  bsonfree(void *ptr);
 
+/* Per document bump allocator. Normally it grabs geometrically growing
+ * blocks through the hooks above and frees them all at once; given a
+ * caller buffer it never touches the heap and fails once the buffer is
+ * full. Temporaries come off the other end of a fixed buffer (or straight
+ * from the heap) and must be returned in reverse order. */
+typedef struct _s_bsonblock bsonblock;
+typedef struct {
+    char       *base;
+    uint64_t    size;
+    uint64_t    used;
+    uint64_t    top;
+    bsonblock  *blocks;
+    int         fixed;
+    uint64_t    allocs;
+    uint64_t    allocbytes;
+    uint64_t    heapallocs;
+    uint64_t    heapbytes;
+} bsonarena;
+
+void  bsonarena_init(bsonarena *a);
+void  bsonarena_fixed(bsonarena *a, void *buffer, uint64_t size);
+void *bsonarena_alloc(bsonarena *a, uint64_t size, uint64_t align);
+void *bsonarena_calloc(bsonarena *a, uint64_t size, uint64_t align);
+char *bsonarena_strdup(bsonarena *a, const char *str);
+void  bsonarena_trim(bsonarena *a, void *ptr, uint64_t size, uint64_t newsize);
+void *bsonarena_temp(bsonarena *a, uint64_t size);
+void  bsonarena_untemp(bsonarena *a, void *ptr, uint64_t size);
+void  bsonarena_release(bsonarena *a);
+
 #endif
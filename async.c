@@ -0,0 +1,140 @@
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bson.h"
+#include "allocator.h"
+
+#define POOL_THREADS 8
+
+struct _s_bsonticket {
+    char            *filepath;
+    bsonopts         opts;
+    int              hasopts;
+    bson_pfn_opened  done;
+    void            *ud;
+    BSON            *bson;
+    bsonenum         result;
+    int              finished;
+    bsonticket      *next;
+};
+
+/* One queue and one lock for every pool thread; opens take milliseconds,
+ * so contention on it never shows. */
+static struct {
+    pthread_mutex_t  lock;
+    pthread_cond_t   work;
+    pthread_cond_t   finished;
+    bsonticket      *head;
+    bsonticket      *tail;
+    int              threads;
+} pool = {
+    .lock     = PTHREAD_MUTEX_INITIALIZER,
+    .work     = PTHREAD_COND_INITIALIZER,
+    .finished = PTHREAD_COND_INITIALIZER
+};
+
+static void free_ticket(bsonticket *t) {
+    if(t->filepath != NULL)
+	bsonfree(t->filepath);
+    bsonfree(t);
+}
+
+static void *pool_thread(void *unused) {
+    for(;;) {
+	pthread_mutex_lock(&pool.lock);
+	while(pool.head == NULL)
+	    pthread_cond_wait(&pool.work, &pool.lock);
+	bsonticket *t = pool.head;
+	pool.head = t->next;
+	if(pool.head == NULL)
+	    pool.tail = NULL;
+	pthread_mutex_unlock(&pool.lock);
+
+	t->bson = bson_open_opts(t->filepath, t->hasopts ? &t->opts : NULL, &t->result);
+	if(t->done != NULL) {
+	    t->done(t->bson, t->result, t->ud);
+	    free_ticket(t);
+	    continue;
+	}
+	pthread_mutex_lock(&pool.lock);
+	t->finished = 1;
+	pthread_cond_broadcast(&pool.finished);
+	pthread_mutex_unlock(&pool.lock);
+    }
+    return NULL;
+}
+
+/* Called with the lock held. One thread per core, up to POOL_THREADS. */
+static int start_pool(void) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int want = cores < 1 ? 1 : cores > POOL_THREADS ? POOL_THREADS : (int)(cores);
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    while(pool.threads < want) {
+	pthread_t thread;
+	if(pthread_create(&thread, &attr, pool_thread, NULL) != 0)
+	    break;
+	pool.threads++;
+    }
+    pthread_attr_destroy(&attr);
+    return pool.threads > 0;
+}
+
+bsonticket *bson_open_async(const char *filepath, const bsonopts *opts, bson_pfn_opened done, void *ud, bsonenum *result) {
+    bsonenum ret = BSON_NULL_PTR;
+    bsonticket *t = NULL;
+    if(filepath == NULL)
+	goto fail;
+    ret = BSON_MEMORY;
+    if((t = bsoncalloc(1, sizeof(bsonticket))) == NULL || (t->filepath = bsonstrdup(filepath)) == NULL)
+	goto fail;
+    if(opts != NULL) {
+	t->opts    = *opts;
+	t->hasopts = 1;
+    }
+    t->done = done;
+    t->ud   = ud;
+
+    pthread_mutex_lock(&pool.lock);
+    if(pool.threads == 0 && !start_pool()) {
+	pthread_mutex_unlock(&pool.lock);
+	goto fail;
+    }
+    if(pool.tail != NULL)
+	pool.tail->next = t;
+    else
+	pool.head = t;
+    pool.tail = t;
+    pthread_cond_signal(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+
+    if(result != NULL)
+	*result = BSON_SUCCESS;
+    return done == NULL ? t : NULL;
+
+fail:
+    if(t != NULL)
+	free_ticket(t);
+    if(result != NULL)
+	*result = ret;
+    return NULL;
+}
+
+BSON *bson_wait(bsonticket *ticket, bsonenum *result) {
+    if(ticket == NULL) {
+	if(result != NULL)
+	    *result = BSON_NULL_PTR;
+	return NULL;
+    }
+    pthread_mutex_lock(&pool.lock);
+    while(!ticket->finished)
+	pthread_cond_wait(&pool.finished, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+    BSON *bson = ticket->bson;
+    if(result != NULL)
+	*result = ticket->result;
+    free_ticket(ticket);
+    return bson;
+}
@@ -0,0 +1,62 @@
+#include "bloom.h"
+
+#include <string.h>
+
+#define BLOOM_BITS_PER_KEY  10
+#define BLOOM_PROBES         6
+#define BLOOM_BLOCK_WORDS    8
+#define BLOOM_BLOCK_BITS   512
+#define BLOOM_ALIGN         64
+
+/* Bit positions come from a remix of the whole hash, 9 bits apiece */
+static inline uint64_t bloom_mix(uint64_t hash) {
+    hash ^= hash >> 33;
+    hash *= 0x9E3779B97F4A7C15ULL;
+    return hash ^ (hash >> 29);
+}
+
+int bson_bloom_init(bsonbloom *bloom, bsonarena *arena, uint64_t keys) {
+    memset(bloom, 0, sizeof(bsonbloom));
+    if(keys == 0)
+	return 1;
+    bloom->blocks = (keys * BLOOM_BITS_PER_KEY + BLOOM_BLOCK_BITS - 1) / BLOOM_BLOCK_BITS;
+    if(bloom->blocks > UINT32_MAX)
+	bloom->blocks = UINT32_MAX;
+    uint64_t size = bloom->blocks * BLOOM_BLOCK_WORDS * sizeof(uint64_t);
+    bloom->bits = bsonarena_calloc(arena, size, BLOOM_ALIGN);
+    return bloom->bits != NULL;
+}
+
+void bson_bloom_add(bsonbloom *bloom, uint64_t hash) {
+    uint64_t *block = (uint64_t *)bson_bloom_block(bloom, hash);
+    uint64_t  mix   = bloom_mix(hash);
+    int i;
+    for(i = 0; i < BLOOM_PROBES; i++, mix >>= 9)
+	block[(mix & 511) >> 6] |= 1ULL << (mix & 63);
+}
+
+int bson_bloom_test(const bsonbloom *bloom, uint64_t hash) {
+    const uint64_t *block = bson_bloom_block(bloom, hash);
+    uint64_t        mix   = bloom_mix(hash);
+    int i;
+    for(i = 0; i < BLOOM_PROBES; i++, mix >>= 9) {
+	if(!(block[(mix & 511) >> 6] & (1ULL << (mix & 63))))
+	    return 0;
+    }
+    return 1;
+}
+
+/* Estimated from the actual fill: a probe passes when all of its bits are
+ * set, so roughly (set / total)^k. */
+double bson_bloom_fpr(const bsonbloom *bloom) {
+    if(bloom->blocks == 0)
+	return 0.0;
+    uint64_t words = bloom->blocks * BLOOM_BLOCK_WORDS, set = 0, i;
+    for(i = 0; i < words; i++)
+	set += __builtin_popcountll(bloom->bits[i]);
+    double fill = (double)(set) / (double)(words * 64), fpr = 1.0;
+    int k;
+    for(k = 0; k < BLOOM_PROBES; k++)
+	fpr *= fill;
+    return fpr;
+}
@@ -0,0 +1,30 @@
+#ifndef _BSON_BLOOM_H_
+#define _BSON_BLOOM_H_
+
+#include <stdint.h>
+
+#include "allocator.h"
+
+/* Blocked Bloom filter: every key lives in one 64 byte block, so a probe
+ * touches a single cache line no matter how many bits are tested. */
+typedef struct {
+    uint64_t  blocks;
+    uint64_t *bits;
+} bsonbloom;
+
+/* The block comes from the high half of the hash */
+static inline const uint64_t *bson_bloom_block(const bsonbloom *bloom, uint64_t hash) {
+    uint64_t i = ((hash >> 32) * bloom->blocks) >> 32;
+    return bloom->bits + i * 8;
+}
+
+static inline void bson_bloom_prefetch(const bsonbloom *bloom, uint64_t hash) {
+    __builtin_prefetch(bson_bloom_block(bloom, hash));
+}
+
+int     bson_bloom_init(bsonbloom *bloom, bsonarena *arena, uint64_t keys);
+void    bson_bloom_add(bsonbloom *bloom, uint64_t hash);
+int     bson_bloom_test(const bsonbloom *bloom, uint64_t hash);
+double  bson_bloom_fpr(const bsonbloom *bloom);
+
+#endif
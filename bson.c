@@ -1,26 +1,48 @@
+#define _GNU_SOURCE
 #include "bson.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "allocator.h"
 #include "util.h"
+#include "bloom.h"
+#include "mph.h"
+#include "convert.h"
+#include "intern.h"
+#include "unpack.h"
 
 #define MAX_ELEMENTS   32
 #define MORE_STACK    256
 #define MORE_LEFT      64
 #define MORE_RIGHT    128
-#define MORE_ARRAY     32
+#define MORE_SCOPES    32
+#define MORE_INPUT  16384
+#define FIXED_LINE   4096
+#define FIXED_INTERN 1024
+#define MAX_INCLUDES   16
 
 /*    ELEMENT   */
 
 typedef struct _s_element_t {
-    char                *name;
+    const bsonpath      *path; /* Enclosing objects, NULL at the top */
+    const char          *leaf;
     void                *data;
+    uint64_t             hash;
     bsonenum               type;
+    uint8_t              narrow; /* Bytes per item when compacted, else 0 */
+    uint64_t             reads;  /* With BSON_OPT_PROFILE */
+    uint64_t             vhash;  /* Of the items as parsed, before narrowing */
     struct _s_element_t *next;
+    struct _s_element_t *sibling; /* Next key in the same scope */
 } element_t;
 
 /*              */
@@ -28,36 +50,145 @@ typedef struct _s_element_t {
 
 /* HASHED CONFIG */
 
-static bsonenum begin_read(BSON *bson);
+static bsonenum begin_read(BSON *bson, const bsonopts *opts);
+static bsonenum build_bloom(BSON *bson);
+static bsonenum clone_bson(const BSON *src, BSON *dst);
+static bsonenum move_to_copy(BSON *bson, bsonarena *old);
+static const element_t **sort_elements(const BSON *bson, bsonarena *a);
+static void link_entry(BSON *bson, element_t *e);
+
+/* An arena bson_relayout() moved away from, kept for the pointers into it */
+typedef struct _s_retired {
+    bsonarena           arena;
+    struct _s_retired  *next;
+} retired_t;
+
 struct _s_BSON {
     char        *filename;
     uint64_t     elementsmax;
     element_t  **elements;
+    uint64_t     count;
+    uint64_t     maxkeys;
+    bsonbloom    bloom;
+    uint64_t     bloomprobes;
+    uint64_t     bloomrejects;
+    uint64_t     bloomfalse;
+    bsonmph      mph;
+    element_t   *frozen;
+    bsonarena    arena;
+    uint64_t     bytesread;
+    uint64_t     lines;
+    uint64_t     iotime;
+    uint64_t     parsetime;
+    uint64_t     indextime;
+    uint64_t     freezetime;
+    uint64_t     hits;
+    uint64_t     misses;
+    bson_pfn_trace trace;
+    void        *traceud;
+    char        *shm;
+    uint64_t     shmsize;
+    uint64_t     shmprivate; /* Mapping relocated into a private copy */
+    unsigned     flags;
+    uint64_t     narrowsaved;
+    bsonpath    *paths;
+    uint64_t     internsaved;
+    bson_pfn_visit visit;
+    void        *visitud;
+    uint64_t     includes;
+    uint64_t     includehits;
+    uint64_t     packedbytes;
+    uint64_t     fingerprint;
+    bsonpath    *toppaths;
+    element_t   *topentries;
+    retired_t   *retired;
+    uint64_t     deadbytes;
 };
 
+static void trace_phase(const BSON *bson, const char *phase, uint64_t nanos) {
+    if(bson->trace == NULL)
+	return;
+    bsontrace t = {
+	.type     = BSON_TRACE_PHASE,
+	.filename = bson->filename,
+	.phase    = phase,
+	.nanos    = nanos
+    };
+    bson->trace(&t, bson->traceud);
+}
+
 BSON *bson_open(const char *filepath, bsonenum *result) {
-    BSON *bson = bsoncalloc(1, sizeof(BSON));
+    return bson_open_opts(filepath, NULL, result);
+}
+
+/* With a caller buffer the BSON itself goes at the front of it and the arena
+ * gets the rest; nothing below this point calls the heap. */
+static BSON *new_bson(const bsonopts *opts) {
+    BSON *bson;
+    if(opts == NULL || opts->buffer == NULL) {
+	bson = bsoncalloc(1, sizeof(BSON));
+	if(bson != NULL) {
+	    bsonarena_init(&bson->arena);
+	    bson->arena.heapallocs = 1;
+	    bson->arena.heapbytes  = sizeof(BSON);
+	}
+	return bson;
+    }
+    uintptr_t start = ((uintptr_t)(opts->buffer) + 15) & ~(uintptr_t)(15);
+    uint64_t  skip  = start - (uintptr_t)(opts->buffer) + sizeof(BSON);
+    if(opts->buffersize < skip)
+	return NULL;
+    bson = (BSON *)(start);
+    memset(bson, 0, sizeof(BSON));
+    bsonarena_fixed(&bson->arena, (char *)(opts->buffer) + skip, opts->buffersize - skip);
+    return bson;
+}
+
+BSON *bson_open_opts(const char *filepath, const bsonopts *opts, bsonenum *result) {
+    BSON *bson = new_bson(opts);
     if(bson == NULL) {
-	*result = BSON_MEMORY;
+	if(result != NULL)
+	    *result = BSON_MEMORY;
 	return NULL;
     }
-    bson->filename = bsonstrdup(filepath);
-    bson->elementsmax = MAX_ELEMENTS;
-    bson->elements = bsoncalloc(bson->elementsmax, sizeof(element_t *));
+    if(opts != NULL) {
+	bson->flags   = opts->flags;
+	bson->maxkeys = opts->maxkeys;
+	bson->trace   = opts->trace;
+	bson->traceud = opts->traceud;
+	bson->visit   = opts->visit;
+	bson->visitud = opts->visitud;
+    }
+    bson->filename = bsonarena_strdup(&bson->arena, filepath);
+    bson->elementsmax = bson->maxkeys > 0 ? bson->maxkeys : MAX_ELEMENTS;
+    bson->elements = bsonarena_calloc(&bson->arena, bson->elementsmax * sizeof(element_t *), sizeof(element_t *));
     if(bson->filename == NULL || bson->elements == NULL) {
 	bson_free(&bson, NULL);
-	*result = BSON_MEMORY;
+	if(result != NULL)
+	    *result = BSON_MEMORY;
 	return NULL;
     }
 
-    bsonenum ret = begin_read(bson);
+    uint64_t start = bson_nanos();
+    bsonenum ret = begin_read(bson, opts);
+    uint64_t parsed = bson_nanos();
+    bson->parsetime = parsed - start - bson->iotime;
+    trace_phase(bson, "read", bson->iotime);
+    trace_phase(bson, "parse", bson->parsetime);
+    if(ret == BSON_SUCCESS) {
+	ret = build_bloom(bson);
+	bson->indextime = bson_nanos() - parsed;
+	trace_phase(bson, "index", bson->indextime);
+    }
     if(ret != BSON_SUCCESS) {
+	bson_free(&bson, NULL);
 	if(result != NULL)
 	    *result = ret;
 	return NULL;
     }
     
-    *result = BSON_SUCCESS;
+    if(result != NULL)
+	*result = BSON_SUCCESS;
     return bson;
 }
 
@@ -68,67 +199,260 @@ void bson_free(BSON **bson, bsonenum *result) {
 	return;
     }
 
-    if((*bson)->filename != NULL) 
-	bsonfree((*bson)->filename);
-    
-    char **start;
-    uint64_t i, j;
-    size_t len;
-    if((*bson)->elements != NULL) {
-	for(i = 0; i < (*bson)->elementsmax; i++) {
-	    element_t *cur = (*bson)->elements[i];
-	    element_t *tmp;
-	    while(cur != NULL) {
-		tmp = cur->next;
-		if(cur->type == BSON_STR) {
-		    len = *((size_t *)(cur->data));
-		    start = (char **)((size_t *)(cur->data) + 1);
-		    for(j = 0; j < len; j++)
-			bsonfree(start[j]);
-		}
-		bsonfree(cur->name);
-		bsonfree(cur->data);
-		bsonfree(cur);
-		cur = tmp;
-	    }
-	}
-	bsonfree((*bson)->elements);
+    if((*bson)->shm != NULL) {
+	munmap((*bson)->shm, (*bson)->shmsize);
+	bsonfree(*bson);
+	*bson = NULL;
+	if(result != NULL)
+	    *result = BSON_SUCCESS;
+	return;
     }
 
-    bsonfree(*bson);
+    retired_t *r = (*bson)->retired, *next;
+    for(; r != NULL; r = next) {
+	next = r->next;
+	bsonarena_release(&r->arena);
+	bsonfree(r);
+    }
+    /* Everything hangs off the arena, the BSON too if it sits in a buffer */
+    bsonarena arena = (*bson)->arena;
+    if(!arena.fixed)
+	bsonfree(*bson);
+    bsonarena_release(&arena);
     *bson = NULL;
     if(result != NULL)
 	*result = BSON_SUCCESS;
 }
 
-long long *bson_int(BSON *bson, const char *name) {
-    element_t *cur = bson->elements[bson_hash(name) % bson->elementsmax];
-    while(cur != NULL) {
-	if(strcmp(name, cur->name) == 0)
-	    return (long long *)((size_t *)(cur->data) + 1);
-	cur = cur->next;
+/* First candidate for a hash: its frozen slot, or the head of its bucket */
+static element_t *first_candidate(const BSON *bson, uint64_t hash) {
+    if(bson->frozen != NULL)
+	return &bson->frozen[bson_mph_lookup(&bson->mph, hash)];
+    return bson->elements[hash % bson->elementsmax];
+}
+
+/* Compares back to front: the leaf, then each enclosing segment */
+static int name_matches(const element_t *e, const char *name) {
+    uint64_t len = strlen(name), leaflen = strlen(e->leaf);
+    if(len < leaflen || memcmp(name + len - leaflen, e->leaf, leaflen) != 0)
+	return 0;
+    len -= leaflen;
+    const bsonpath *p;
+    for(p = e->path; p != NULL; p = p->parent) {
+	if(len < p->seglen + 1 || name[len - 1] != '.')
+	    return 0;
+	len -= p->seglen + 1;
+	if(memcmp(name + len, p->segment, p->seglen) != 0)
+	    return 0;
     }
-    return NULL;
+    return len == 0;
 }
 
-double *bson_dbl(BSON *bson, const char *name) {
-    element_t *cur = bson->elements[bson_hash(name) % bson->elementsmax];
+static element_t *match_element(const BSON *bson, element_t *cur, const char *name, uint64_t hash) {
+    if(bson->frozen != NULL)
+	return cur->hash == hash && name_matches(cur, name) ? cur : NULL;
     while(cur != NULL) {
-	if(strcmp(name, cur->name) == 0)
-	    return (double *)((size_t *)(cur->data) + 1);
+	if(cur->hash == hash && name_matches(cur, name))
+	    return cur;
 	cur = cur->next;
     }
     return NULL;
 }
 
+/* Lookup counters are kept only with BSON_OPT_COUNT, so plain lookups
+ * write nothing to the document, and atomically, since lookups on a
+ * loaded document may come from many threads at once. */
+static void bump(const BSON *bson, uint64_t *counter) {
+    if(bson->flags & BSON_OPT_COUNT)
+	__atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+}
+
+/* Misses are the common case for optional keys, so the filter gets the
+ * first word before any bucket is touched. */
+static element_t *probe_element(BSON *bson, const char *name, uint64_t hash) {
+    if(bson->bloom.bits != NULL) {
+	bump(bson, &bson->bloomprobes);
+	if(!bson_bloom_test(&bson->bloom, hash)) {
+	    bump(bson, &bson->bloomrejects);
+	    return NULL;
+	}
+    }
+    element_t *e = match_element(bson, first_candidate(bson, hash), name, hash);
+    if(e == NULL && bson->bloom.bits != NULL)
+	bump(bson, &bson->bloomfalse);
+    return e;
+}
+
+static void count_lookup(BSON *bson, const char *name, element_t *e) {
+    bump(bson, e != NULL ? &bson->hits : &bson->misses);
+    if(e != NULL && (bson->flags & BSON_OPT_PROFILE))
+	__atomic_fetch_add(&e->reads, 1, __ATOMIC_RELAXED);
+    if(bson->trace != NULL) {
+	bsontrace t = {
+	    .type     = BSON_TRACE_LOOKUP,
+	    .filename = bson->filename,
+	    .key      = name,
+	    .hit      = e != NULL
+	};
+	bson->trace(&t, bson->traceud);
+    }
+}
+
+static element_t *find_element(BSON *bson, const char *name) {
+    element_t *e = probe_element(bson, name, bson_hash(name));
+    count_lookup(bson, name, e);
+    return e;
+}
+
+uint64_t bson_key_hash(const char *name) {
+    return bson_hash(name);
+}
+
+/* Narrowed arrays have no long long or double to point at */
+static void *element_value(const element_t *e) {
+    if(e == NULL || e->narrow)
+	return NULL;
+    return (size_t *)(e->data) + 1;
+}
+
+long long *bson_int(BSON *bson, const char *name) {
+    return element_value(find_element(bson, name));
+}
+
+double *bson_dbl(BSON *bson, const char *name) {
+    return element_value(find_element(bson, name));
+}
+
 char **bson_str(BSON *bson, const char *name) {
-    element_t *cur = bson->elements[bson_hash(name) % bson->elementsmax];
-    while(cur != NULL) {
-	if(strcmp(name, cur->name) == 0)
-	    return (char **)((size_t *)(cur->data) + 1);
-	cur = cur->next;
+    return element_value(find_element(bson, name));
+}
+
+void *bson_find(BSON *bson, const char *name, uint64_t hash, bsonenum *type) {
+    element_t *e = probe_element(bson, name, hash);
+    count_lookup(bson, name, e);
+    if(type != NULL)
+	*type = e == NULL ? BSON_NOT_FOUND : e->narrow ? BSON_INVALID_VALUE : e->type;
+    return element_value(e);
+}
+
+static size_t read_numbers(BSON *bson, const char *name, bsonenum type, void *dst, size_t first, size_t count) {
+    element_t *e = find_element(bson, name);
+    if(e == NULL || e->type != type)
+	return 0;
+    size_t len = *((size_t *)(e->data));
+    if(first >= len)
+	return 0;
+    if(dst == NULL || count > len - first)
+	count = len - first;
+    if(dst == NULL)
+	return count;
+    int width = e->narrow ? e->narrow : sizeof(long long);
+    const char *src = (const char *)((size_t *)(e->data) + 1) + first * width;
+    if(type == BSON_INT)
+	bson_widen_int(dst, src, width, count);
+    else
+	bson_widen_dbl(dst, src, width, count);
+    return count;
+}
+
+size_t bson_int_read(BSON *bson, const char *name, long long *dst, size_t first, size_t count) {
+    return read_numbers(bson, name, BSON_INT, dst, first, count);
+}
+
+size_t bson_dbl_read(BSON *bson, const char *name, double *dst, size_t first, size_t count) {
+    return read_numbers(bson, name, BSON_DBL, dst, first, count);
+}
+
+size_t bson_copy(BSON *bson, const char *name, bsonas as, void *dst, size_t stride, size_t first, size_t count, unsigned flags, bsonenum *result) {
+    bsonenum ret = BSON_SUCCESS;
+    size_t len, copied = 0;
+    element_t *e;
+    if(bson == NULL || name == NULL || dst == NULL)
+	ret = BSON_NULL_PTR;
+    else if(as > BSON_AS_DOUBLE)
+	ret = BSON_INVALID_VALUE;
+    else if((e = find_element(bson, name)) == NULL)
+	ret = BSON_NOT_FOUND;
+    else if(e->type != BSON_INT && e->type != BSON_DBL)
+	ret = BSON_INVALID_VALUE;
+    else if((len = *((size_t *)(e->data))) > first) {
+	if(count > len - first)
+	    count = len - first;
+	int width = e->narrow ? e->narrow : sizeof(long long);
+	const char *src = (const char *)((size_t *)(e->data) + 1) + first * width;
+	if(bson_convert(dst, stride, as, src, e->type, width, count) > 0 && !(flags & BSON_COPY_SATURATE))
+	    ret = BSON_INVALID_VALUE;
+	copied = count;
     }
-    return NULL;
+    if(result != NULL)
+	*result = ret;
+    return copied;
+}
+
+/* Each stage runs across the whole window before the next one starts, so
+ * the cache misses of one key overlap with the work on the others instead
+ * of being paid one after another. */
+#define BATCH_WINDOW 16
+
+size_t bson_batch(BSON *bson, bsonkey *keys, size_t count) {
+    uint64_t   hashes[BATCH_WINDOW];
+    element_t *cand[BATCH_WINDOW];
+    size_t     found = 0, i, j, n;
+    int        bloom = bson->bloom.bits != NULL;
+    for(i = 0; i < count; i += n) {
+	bsonkey *k = keys + i;
+	n = count - i < BATCH_WINDOW ? count - i : BATCH_WINDOW;
+
+	for(j = 0; j < n; j++) {
+	    hashes[j] = bson_hash(k[j].name);
+	    if(bloom)
+		bson_bloom_prefetch(&bson->bloom, hashes[j]);
+	    if(bson->frozen != NULL)
+		bson_mph_prefetch(&bson->mph, hashes[j]);
+	    else
+		__builtin_prefetch(&bson->elements[hashes[j] % bson->elementsmax]);
+	}
+
+	for(j = 0; j < n; j++) {
+	    cand[j] = NULL;
+	    if(bloom) {
+		bump(bson, &bson->bloomprobes);
+		if(!bson_bloom_test(&bson->bloom, hashes[j])) {
+		    bump(bson, &bson->bloomrejects);
+		    continue;
+		}
+	    }
+	    cand[j] = first_candidate(bson, hashes[j]);
+	    if(cand[j] != NULL)
+		__builtin_prefetch(cand[j]);
+	}
+
+	for(j = 0; j < n; j++) {
+	    if(cand[j] != NULL)
+		__builtin_prefetch(cand[j]->leaf);
+	}
+
+	for(j = 0; j < n; j++) {
+	    element_t *e = NULL;
+	    if(cand[j] != NULL) {
+		e = match_element(bson, cand[j], k[j].name, hashes[j]);
+		if(e == NULL && bloom)
+		    bump(bson, &bson->bloomfalse);
+	    }
+	    count_lookup(bson, k[j].name, e);
+	    k[j].data = NULL;
+	    if(e == NULL)
+		k[j].result = BSON_NOT_FOUND;
+	    else if((k[j].type != BSON_MAX && k[j].type != e->type) || e->narrow)
+		k[j].result = BSON_INVALID_VALUE;
+	    else {
+		k[j].data   = element_value(e);
+		k[j].result = BSON_SUCCESS;
+		found++;
+	    }
+	}
+    }
+    return found;
 }
 
 void *bson_dat(BSON *bson, const char *name, bsonenum *result) {
@@ -140,6 +464,180 @@ size_t bson_len(void *ptr) {
     return *((size_t *)(ptr) - 1);
 }
 
+bsonenum bson_stats(const BSON *bson, bsonstats *stats) {
+    if(bson == NULL || stats == NULL)
+	return BSON_NULL_PTR;
+    memset(stats, 0, sizeof(bsonstats));
+    stats->keys         = bson->count;
+    stats->frozen       = bson->frozen != NULL;
+    stats->indexbytes   = bson->frozen != NULL ?
+			  bson_mph_bytes(&bson->mph) :
+			  bson->elementsmax * sizeof(element_t *) + bson->count * sizeof(element_t *);
+    stats->bloombits    = bson->bloom.blocks * 512;
+    stats->bloomprobes  = bson->bloomprobes;
+    stats->bloomrejects = bson->bloomrejects;
+    stats->bloomfalse   = bson->bloomfalse;
+    if(bson->bloomrejects + bson->bloomfalse > 0)
+	stats->bloomfpr = (double)(bson->bloomfalse) / (double)(bson->bloomrejects + bson->bloomfalse);
+    stats->bloomfprest  = bson_bloom_fpr(&bson->bloom);
+    stats->bytesread    = bson->bytesread;
+    stats->lines        = bson->lines;
+    stats->iotime       = bson->iotime;
+    stats->parsetime    = bson->parsetime;
+    stats->indextime    = bson->indextime;
+    stats->freezetime   = bson->freezetime;
+    stats->allocs       = bson->arena.allocs;
+    stats->allocbytes   = bson->arena.allocbytes;
+    stats->heapallocs   = bson->arena.heapallocs;
+    stats->heapbytes    = bson->arena.heapbytes;
+    stats->hits         = bson->hits;
+    stats->misses       = bson->misses;
+    stats->narrowsaved  = bson->narrowsaved;
+    stats->internsaved  = bson->internsaved;
+    stats->includes     = bson->includes;
+    stats->includehits  = bson->includehits;
+    stats->packedbytes  = bson->packedbytes;
+    stats->shmprivate   = bson->shmprivate;
+    stats->deadbytes    = bson->deadbytes;
+    if(bson->frozen != NULL) {
+	stats->buckets    = bson->mph.slots;
+	stats->loadfactor = (double)(bson->count) / (double)(bson->mph.slots);
+	return BSON_SUCCESS;
+    }
+    stats->buckets      = bson->elementsmax;
+    stats->loadfactor   = (double)(bson->count) / (double)(bson->elementsmax);
+    uint64_t i, len;
+    element_t *cur;
+    for(i = 0; i < bson->elementsmax; i++) {
+	for(len = 0, cur = bson->elements[i]; cur != NULL; cur = cur->next)
+	    len++;
+	stats->chains[len < BSON_CHAIN_BINS ? len : BSON_CHAIN_BINS - 1]++;
+    }
+    return BSON_SUCCESS;
+}
+
+/* Trade the chained table for a minimal perfect hash over the final key set.
+ * Entries get packed in slot order, so a lookup is the pilot read, one entry
+ * read and one compare. */
+bsonenum bson_freeze(BSON *bson) {
+    if(bson == NULL)
+	return BSON_NULL_PTR;
+    if(bson->frozen != NULL || bson->count == 0)
+	return BSON_SUCCESS;
+    if(bson->shm != NULL)
+	return BSON_INVALID_VALUE;
+    uint64_t start = bson_nanos();
+
+    uint64_t *hashes = bsonarena_temp(&bson->arena, bson->count * sizeof(uint64_t));
+    if(hashes == NULL)
+	return BSON_MEMORY;
+    uint64_t i, n = 0;
+    element_t *cur;
+    for(i = 0; i < bson->elementsmax; i++) {
+	for(cur = bson->elements[i]; cur != NULL; cur = cur->next)
+	    hashes[n++] = cur->hash;
+    }
+    bsonenum ret = bson_mph_build(&bson->mph, &bson->arena, hashes, n);
+    bsonarena_untemp(&bson->arena, hashes, bson->count * sizeof(uint64_t));
+    if(ret != BSON_SUCCESS)
+	return ret;
+    element_t *frozen = bsonarena_alloc(&bson->arena, n * sizeof(element_t), sizeof(void *));
+    if(frozen == NULL) {
+	memset(&bson->mph, 0, sizeof(bsonmph));
+	return BSON_MEMORY;
+    }
+
+    for(i = 0; i < bson->elementsmax; i++) {
+	for(cur = bson->elements[i]; cur != NULL; cur = cur->next)
+	    frozen[bson_mph_lookup(&bson->mph, cur->hash)] = *cur;
+    }
+    bsonpath *p;
+    for(p = bson->paths; p != NULL; p = p->next)
+	p->entries = NULL;
+    bson->topentries = NULL;
+    for(i = 0; i < n; i++) {
+	frozen[i].next = NULL;
+	link_entry(bson, &frozen[i]);
+    }
+    uint64_t dead = bson->elementsmax * sizeof(element_t *) + n * sizeof(element_t);
+    bson->elements    = NULL;
+    bson->elementsmax = 0;
+    bson->frozen      = frozen;
+    /* The chains are dead now. On the heap the document moves to a fresh
+     * arena without them; a buffer, or a copy that fails, keeps them. */
+    bsonarena old;
+    if(bson->arena.fixed || move_to_copy(bson, &old) != BSON_SUCCESS)
+	bson->deadbytes += dead;
+    else
+	bsonarena_release(&old);
+    bson->freezetime  = bson_nanos() - start;
+    trace_phase(bson, "freeze", bson->freezetime);
+    return BSON_SUCCESS;
+}
+
+/* Deep copies the document into a fresh arena, hottest key first, and
+ * swaps it in; the arena it was in goes to old. */
+static bsonenum move_to_copy(BSON *bson, bsonarena *old) {
+    BSON copy;
+    memset(&copy, 0, sizeof(BSON));
+    bsonarena_init(&copy.arena);
+    bsonenum ret = clone_bson(bson, &copy);
+    if(ret != BSON_SUCCESS) {
+	bsonarena_release(&copy.arena);
+	return ret;
+    }
+    *old = bson->arena;
+    bson->arena    = copy.arena;
+    bson->arena.heapallocs += 1;
+    bson->arena.heapbytes  += sizeof(BSON);
+    bson->filename = copy.filename;
+    bson->elements = copy.elements;
+    bson->frozen   = copy.frozen;
+    bson->mph      = copy.mph;
+    bson->bloom    = copy.bloom;
+    bson->paths    = copy.paths;
+    bson->toppaths = copy.toppaths;
+    bson->topentries = copy.topentries;
+    return BSON_SUCCESS;
+}
+
+/* The old arena stays until bson_free(), so values handed out before stay
+ * good. Counters carry over, so it can be run again as the mix changes. */
+bsonenum bson_relayout(BSON *bson) {
+    if(bson == NULL)
+	return BSON_NULL_PTR;
+    if(bson->shm != NULL || bson->arena.fixed)
+	return BSON_INVALID_VALUE;
+    uint64_t start = bson_nanos();
+    retired_t *r = bsonmalloc(sizeof(retired_t));
+    if(r == NULL)
+	return BSON_MEMORY;
+    bsonenum ret = move_to_copy(bson, &r->arena);
+    if(ret != BSON_SUCCESS) {
+	bsonfree(r);
+	return ret;
+    }
+    r->next = bson->retired;
+    bson->retired = r;
+    bson->deadbytes += r->arena.allocbytes;
+    trace_phase(bson, "relayout", bson_nanos() - start);
+    return BSON_SUCCESS;
+}
+
+static bsonenum build_bloom(BSON *bson) {
+    if(!bson_bloom_init(&bson->bloom, &bson->arena, bson->count))
+	return BSON_MEMORY;
+    if(bson->bloom.bits == NULL)
+	return BSON_SUCCESS;
+    uint64_t i;
+    for(i = 0; i < bson->elementsmax; i++) {
+	element_t *cur;
+	for(cur = bson->elements[i]; cur != NULL; cur = cur->next)
+	    bson_bloom_add(&bson->bloom, cur->hash);
+    }
+    return BSON_SUCCESS;
+}
+
 const char *bson_res_str(bsonenum res) {
     switch(res) {
 	case BSON_SUCCESS:  	  return "Result[SUCCESS]";         break;
@@ -161,6 +659,147 @@ const char *bson_res_str(bsonenum res) {
 /*               */
 
 
+/*     DIFF      */
+
+/* Sums over every path spelled name, since a fixed buffer whose intern
+ * table filled up may hold the same one twice */
+static uint64_t find_fingerprint(const bsonpath *first, const char *name, uint64_t len) {
+    const char *dot = memchr(name, '.', len);
+    uint64_t seglen = dot != NULL ? (uint64_t)(dot - name) : len, sum = 0;
+    const bsonpath *p;
+    for(p = first; p != NULL; p = p->sibling) {
+	if(p->seglen != seglen || memcmp(p->segment, name, seglen) != 0)
+	    continue;
+	sum += dot != NULL ? find_fingerprint(p->child, dot + 1, len - seglen - 1) : p->fingerprint;
+    }
+    return sum;
+}
+
+uint64_t bson_fingerprint(const BSON *bson, const char *prefix) {
+    if(bson == NULL)
+	return 0;
+    if(prefix == NULL || *prefix == '\0')
+	return bson->fingerprint;
+    return find_fingerprint(bson->toppaths, prefix, strlen(prefix));
+}
+
+typedef struct {
+    const BSON    *from;
+    const BSON    *to;
+    bson_pfn_diff  changed;
+    void          *ud;
+    char          *name;
+    uint64_t       namemax;
+    size_t         count;
+    int            failed;
+} diffstate;
+
+/* Spells scope.segment into the name buffer, returns the new length */
+static uint64_t diff_name(diffstate *d, uint64_t len, const char *segment, uint64_t seglen) {
+    uint64_t at = len > 0 ? len + 1 : 0;
+    if(at + seglen + 1 > d->namemax) {
+	uint64_t max = (at + seglen + 1) * 2;
+	char *more = bsonrealloc(d->name, max);
+	if(more == NULL) {
+	    d->failed = 1;
+	    return len;
+	}
+	d->name    = more;
+	d->namemax = max;
+    }
+    if(len > 0)
+	d->name[len] = '.';
+    memcpy(d->name + at, segment, seglen);
+    d->name[at + seglen] = '\0';
+    return at + seglen;
+}
+
+static void diff_report(diffstate *d, bsondiff what) {
+    d->count++;
+    if(d->changed != NULL)
+	d->changed(d->name, what, d->ud);
+}
+
+/* The fingerprint of theirs under the name of p (spelled in the buffer up
+ * to len). Any key under p that theirs also has leads, through their
+ * index, to their path of that name; walking their tree is the fallback,
+ * when p has only keys that are gone. Where a fixed buffer split a path in
+ * two this may see only one of them, which at worst descends needlessly. */
+static uint64_t their_fingerprint(diffstate *d, const BSON *theirs, const bsonpath *p, uint64_t len) {
+    const bsonpath *q = p;
+    uint64_t at = len, depth = 0;
+    while(q->entries == NULL && q->child != NULL) {
+	q = q->child;
+	at = diff_name(d, at, q->segment, q->seglen);
+	depth++;
+    }
+    const element_t *e = q->entries, *other = NULL;
+    if(e != NULL && theirs->count > 0) {
+	diff_name(d, at, e->leaf, strlen(e->leaf));
+	if(!d->failed)
+	    other = match_element(theirs, first_candidate(theirs, e->hash), d->name, e->hash);
+    }
+    d->name[len] = '\0';
+    const bsonpath *o = other != NULL ? other->path : NULL;
+    for(; o != NULL && depth > 0; depth--)
+	o = o->parent;
+    if(o != NULL && o->len == len)
+	return o->fingerprint;
+    return find_fingerprint(theirs->toppaths, d->name, len);
+}
+
+/* One side's keys in a scope checked against the other side's index, then
+ * only the child scopes whose fingerprints differ. The from side reports
+ * removals and changes, the to side additions. */
+static void diff_scope(diffstate *d, int adding, const element_t *entries, const bsonpath *children, uint64_t len) {
+    const BSON *theirs = adding ? d->from : d->to;
+    const element_t *e;
+    uint64_t at;
+    for(e = entries; e != NULL && !d->failed; e = e->sibling) {
+	at = diff_name(d, len, e->leaf, strlen(e->leaf));
+	if(d->failed)
+	    return;
+	const element_t *other = theirs->count == 0 ? NULL :
+				 match_element(theirs, first_candidate(theirs, e->hash), d->name, e->hash);
+	if(other == NULL)
+	    diff_report(d, adding ? BSON_DIFF_ADDED : BSON_DIFF_REMOVED);
+	else if(!adding && (other->type != e->type || other->vhash != e->vhash))
+	    diff_report(d, BSON_DIFF_CHANGED);
+    }
+    const bsonpath *p;
+    for(p = children; p != NULL && !d->failed; p = p->sibling) {
+	at = diff_name(d, len, p->segment, p->seglen);
+	if(!d->failed && their_fingerprint(d, theirs, p, at) != p->fingerprint)
+	    diff_scope(d, adding, p->entries, p->child, at);
+    }
+}
+
+size_t bson_diff(const BSON *from, const BSON *to, bson_pfn_diff changed, void *ud, bsonenum *result) {
+    if(from == NULL || to == NULL) {
+	if(result != NULL)
+	    *result = BSON_NULL_PTR;
+	return 0;
+    }
+    diffstate d;
+    memset(&d, 0, sizeof(diffstate));
+    d.from    = from;
+    d.to      = to;
+    d.changed = changed;
+    d.ud      = ud;
+    if(from->fingerprint != to->fingerprint) {
+	diff_scope(&d, 0, from->topentries, from->toppaths, 0);
+	diff_scope(&d, 1, to->topentries, to->toppaths, 0);
+    }
+    if(d.name != NULL)
+	bsonfree(d.name);
+    if(result != NULL)
+	*result = d.failed ? BSON_MEMORY : BSON_SUCCESS;
+    return d.count;
+}
+
+/*               */
+
+
 /* READ CONTEXT */
 
 typedef struct {
@@ -171,83 +810,213 @@ typedef struct {
     uint64_t   rightmax;
     char      *right;
     char       middle[32]; /* Middle should be no more than one char */
-    FILE      *file;
+    int        fd;
+    char      *in;
+    uint64_t   inmax;
+    uint64_t   inlen;
+    uint64_t   inpos;
+    int        ineof;
     uint64_t   lines;
+    uint64_t   statement; /* Line the current key started on */
+    bsonarena *arena;
+    BSON      *bson;
+    bsonintern      intern;
+    const bsonpath *scope;
+    bsonunpack     *unpack; /* Compressed input, NULL for plain */
+    int             inerror;
+    const bsonpath **scopes; /* Where each open { was, a.b { opens two */
+    uint64_t        nscopes;
+    uint64_t        scopesmax;
 } ReadContext;
 
-static bsonenum read(BSON *bson, ReadContext *ctx);
-static bsonenum begin_read(BSON *bson) {
+static bsonenum read_bson(BSON *bson, ReadContext *ctx);
+
+/* Scratch space is a temporary of the document's arena: plain heap memory
+ * normally, carved off the top of the caller's buffer otherwise, where it
+ * cannot grow past the configured line length. */
+static bsonenum begin_read(BSON *bson, const bsonopts *opts) {
     ReadContext ctx;
     memset(&ctx, 0, sizeof(ReadContext));
-    
-    ctx.file = fopen(bson->filename, "r");
-    if(ctx.file == NULL)
-    	return BSON_FILE_PATH;
-
-    ctx.stackmax  = MORE_STACK;
-    ctx.stack     = bsonmalloc(ctx.stackmax);
-    ctx.leftmax   = MORE_LEFT;
-    ctx.left      = bsonmalloc(ctx.leftmax);
-    ctx.rightmax  = MORE_RIGHT;
-    ctx.right     = bsonmalloc(ctx.rightmax);
-    
-    if(ctx.stack == NULL || ctx.left == NULL || ctx.right == NULL) {
-	if(ctx.stack != NULL) bsonfree(ctx.stack);
-	if(ctx.left  != NULL) bsonfree(ctx.left);
-	if(ctx.right != NULL) bsonfree(ctx.right);
-	fclose(ctx.file);
-	return BSON_MEMORY;
+    ctx.arena = &bson->arena;
+    ctx.bson  = bson;
+
+    ctx.fd = open(bson->filename, O_RDONLY);
+    if(ctx.fd < 0)
+	return BSON_FILE_PATH;
+    unsigned char head[2];
+    bsonunpack unpack;
+    if(pread(ctx.fd, head, sizeof(head), 0) == sizeof(head) && bson_unpack_detect(head, sizeof(head))) {
+	/* zlib keeps its state on the heap, which a caller buffer rules out */
+	if(ctx.arena->fixed || !bson_unpack_start(&unpack, ctx.arena, ctx.fd)) {
+	    close(ctx.fd);
+	    return ctx.arena->fixed ? BSON_INVALID_VALUE : BSON_MEMORY;
+	}
+	ctx.unpack = &unpack;
     }
 
-    ctx.stack[0] = '\0';
-    bsonenum ret = read(bson, &ctx);
-    bsonfree(ctx.stack);
-    bsonfree(ctx.left);
-    bsonfree(ctx.right);
-    fclose(ctx.file);
+    uint64_t line = FIXED_LINE;
+    if(opts != NULL && opts->maxline > 0)
+	line = opts->maxline;
+    ctx.inmax     = MORE_INPUT;
+    ctx.stackmax  = ctx.arena->fixed ? line : MORE_STACK;
+    ctx.leftmax   = ctx.arena->fixed ? line : MORE_LEFT;
+    ctx.rightmax  = ctx.arena->fixed ? line : MORE_RIGHT;
+    ctx.in        = bsonarena_temp(ctx.arena, ctx.inmax);
+    ctx.stack     = ctx.in    == NULL ? NULL : bsonarena_temp(ctx.arena, ctx.stackmax);
+    ctx.left      = ctx.stack == NULL ? NULL : bsonarena_temp(ctx.arena, ctx.leftmax);
+    ctx.right     = ctx.left  == NULL ? NULL : bsonarena_temp(ctx.arena, ctx.rightmax);
+    ctx.scopesmax = ctx.arena->fixed ? line / 2 : MORE_SCOPES;
+    ctx.scopes    = ctx.right == NULL ? NULL : bsonarena_temp(ctx.arena, ctx.scopesmax * sizeof(bsonpath *));
+    uint64_t slots = bson->maxkeys > 0 ? bson->maxkeys * 2 : ctx.arena->fixed ? FIXED_INTERN : 0;
+    int interning = ctx.scopes != NULL && bson_intern_init(&ctx.intern, ctx.arena, slots);
+
+    bsonenum ret = BSON_MEMORY;
+    if(interning) {
+	ctx.stack[0] = '\0';
+	ret = read_bson(bson, &ctx);
+	bson->paths       = ctx.intern.all;
+	bson->toppaths    = ctx.intern.top;
+	if(ctx.intern.wanted > ctx.intern.copied)
+	    bson->internsaved = ctx.intern.wanted - ctx.intern.copied;
+	bson_intern_release(&ctx.intern);
+    }
+    if(ctx.unpack != NULL) {
+	bson_unpack_stop(ctx.unpack);
+	bson->packedbytes = unpack.packed;
+    }
+    if(ctx.inerror && (ret == BSON_SUCCESS || ret == BSON_SYNTAX))
+	ret = BSON_INVALID_VALUE;
+    bson->lines = ctx.lines;
+    if(ret != BSON_SUCCESS && bson->trace != NULL) {
+	bsontrace t = {
+	    .type     = BSON_TRACE_ERROR,
+	    .filename = bson->filename,
+	    .result   = ret,
+	    .line     = ctx.statement + 1
+	};
+	bson->trace(&t, bson->traceud);
+    }
+    if(ctx.scopes != NULL) bsonarena_untemp(ctx.arena, ctx.scopes, ctx.scopesmax * sizeof(bsonpath *));
+    if(ctx.right != NULL) bsonarena_untemp(ctx.arena, ctx.right, ctx.rightmax);
+    if(ctx.left  != NULL) bsonarena_untemp(ctx.arena, ctx.left,  ctx.leftmax);
+    if(ctx.stack != NULL) bsonarena_untemp(ctx.arena, ctx.stack, ctx.stackmax);
+    if(ctx.in    != NULL) bsonarena_untemp(ctx.arena, ctx.in,    ctx.inmax);
+    close(ctx.fd);
     return ret;
 }
 
+static bsonenum ctx_grow(ReadContext *ctx, char **buf, uint64_t *max, uint64_t more) {
+    if(ctx->arena->fixed)
+	return BSON_MEMORY;
+    void *tptr = bsonrealloc(*buf, *max + more);
+    if(tptr == NULL)
+	return BSON_MEMORY;
+    ctx->arena->heapallocs++;
+    ctx->arena->heapbytes += more;
+    *buf = tptr;
+    *max += more;
+    return BSON_SUCCESS;
+}
+
+/* The stack is the scope spelled out, for hashing whole names */
 static bsonenum ctx_push(ReadContext *ctx) {
     uint64_t stacklen = strlen(ctx->stack);
     uint64_t leftlen = strlen(ctx->left);
-    if(stacklen + leftlen + 2 > ctx->stackmax) {
-	void *tptr = bsonrealloc(ctx->stack, (ctx->stackmax += MORE_STACK));
+    while(stacklen + leftlen + 2 > ctx->stackmax) {
+	if(ctx_grow(ctx, &ctx->stack, &ctx->stackmax, MORE_STACK) != BSON_SUCCESS)
+	    return BSON_MEMORY;
+    }
+    if(ctx->nscopes == ctx->scopesmax) {
+	if(ctx->arena->fixed)
+	    return BSON_MEMORY;
+	void *tptr = bsonrealloc(ctx->scopes, (ctx->scopesmax + MORE_SCOPES) * sizeof(bsonpath *));
 	if(tptr == NULL)
 	    return BSON_MEMORY;
-	ctx->stack = tptr;
+	ctx->arena->heapallocs++;
+	ctx->arena->heapbytes += MORE_SCOPES * sizeof(bsonpath *);
+	ctx->scopes     = tptr;
+	ctx->scopesmax += MORE_SCOPES;
     }
-    if(stacklen > 0) {
+    const bsonpath *scope = bson_intern_dotted(&ctx->intern, ctx->scope, ctx->left, leftlen);
+    if(scope == NULL)
+	return BSON_MEMORY;
+    ctx->scopes[ctx->nscopes++] = ctx->scope;
+    if(ctx->scope != NULL) {
 	ctx->stack[stacklen] = '.';
 	ctx->stack[stacklen + 1] = '\0';
 	strcat(ctx->stack, ctx->left);
     }
     else
 	strcpy(ctx->stack, ctx->left);
+    ctx->scope = scope;
 
     return BSON_SUCCESS;
 }
 
 static bsonenum ctx_pop(ReadContext *ctx) {
-    uint64_t i = strlen(ctx->stack) - 1;
-    while(ctx->stack[i] != '.' && i != 0)
-	i--;
-    ctx->stack[i] = '\0';
+    if(ctx->nscopes == 0)
+	return BSON_SYNTAX;
+    ctx->scope = ctx->scopes[--ctx->nscopes];
+    ctx->stack[ctx->scope == NULL ? 0 : ctx->scope->len] = '\0';
 
     return BSON_SUCCESS;
 }
 
+/* Makes sure `want` bytes are buffered unless the file ends first */
+static void ctx_fill(ReadContext *ctx, uint64_t want) {
+    if(ctx->inlen - ctx->inpos >= want || ctx->ineof)
+	return;
+    memmove(ctx->in, ctx->in + ctx->inpos, ctx->inlen - ctx->inpos);
+    ctx->inlen -= ctx->inpos;
+    ctx->inpos  = 0;
+    uint64_t start = bson_nanos();
+    while(ctx->inlen < want && !ctx->ineof) {
+	ssize_t got = ctx->unpack != NULL ?
+		      bson_unpack_read(ctx->unpack, ctx->in + ctx->inlen, ctx->inmax - ctx->inlen) :
+		      read(ctx->fd, ctx->in + ctx->inlen, ctx->inmax - ctx->inlen);
+	if(got < 0 && errno == EINTR && ctx->unpack == NULL)
+	    continue;
+	if(got < 0 && ctx->unpack != NULL)
+	    ctx->inerror = 1;
+	if(got <= 0)
+	    ctx->ineof = 1;
+	else {
+	    ctx->inlen += got;
+	    ctx->bson->bytesread += got;
+	}
+    }
+    ctx->bson->iotime += bson_nanos() - start;
+}
+
+static int ctx_peek(ReadContext *ctx, uint64_t ahead) {
+    ctx_fill(ctx, ahead + 1);
+    if(ctx->inpos + ahead >= ctx->inlen)
+	return EOF;
+    return (unsigned char)(ctx->in[ctx->inpos + ahead]);
+}
+
+static int ctx_getc(ReadContext *ctx) {
+    int c = ctx_peek(ctx, 0);
+    if(c == EOF)
+	return EOF;
+    ctx->inpos++;
+    if(c == '\n')
+	ctx->lines++;
+    return c;
+}
+
 /*              */
 
 
 /*    READING    */
 
-#define eof     (feof(ctx->file))
+#define eof     (ctx_peek(ctx, 0) == EOF)
 static bsonenum skip_ignored(ReadContext *ctx);
 static bsonenum check_pop(ReadContext *ctx);
 static bsonenum read_left(ReadContext *ctx);
 static bsonenum read_middle(ReadContext *ctx);
 static bsonenum read_right(ReadContext *ctx);
+static bsonenum read_include(BSON *bson, ReadContext *ctx);
 static bsonenum save_right(BSON *bson, ReadContext *ctx);
 
 #define RETCASE        				\
@@ -257,13 +1026,15 @@ switch(ret) {                      		\
     default:            return ret; break;	\
 }
 
-static bsonenum read(BSON *bson, ReadContext *ctx) {
+static bsonenum read_bson(BSON *bson, ReadContext *ctx) {
     bsonenum ret;
     while(!eof) {
 	ret = skip_ignored(ctx); RETCASE
+	ctx->statement = ctx->lines;
 	ret = check_pop(ctx);    RETCASE
 	ret = read_left(ctx);    RETCASE
 	ret = skip_ignored(ctx); RETCASE
+	ret = read_include(bson, ctx); RETCASE
 	ret = read_middle(ctx);  RETCASE
 	ret = skip_ignored(ctx); RETCASE
 	ret = read_right(ctx);   RETCASE
@@ -273,7 +1044,6 @@ static bsonenum read(BSON *bson, ReadContext *ctx) {
 	if(ret != BSON_SUCCESS)
 	    return ret;
     }
-    bson_debug_print(bson);
     return BSON_SUCCESS;
 }
 
@@ -283,71 +1053,38 @@ static bsonenum read(BSON *bson, ReadContext *ctx) {
 /* READING FUNCS */
 
 static bsonenum skip_ignored(ReadContext *ctx) {
-    if(eof)
-	return BSON_SUCCESS;
-    uint64_t prev = ftell(ctx->file);
-    char pc = 0, c = 0;
-    do {
-	prev = ftell(ctx->file);
-	pc   = c;
-	c    = fgetc(ctx->file);
-	if(c == '/') {
-	    prev = ftell(ctx->file);
-	    pc   = c;
-	    c    = fgetc(ctx->file);
-	}
-	else if(c == '\n')
-	    ctx->lines++;
-	if(c == '/' && pc == '/') {
-	    do {
-		prev = ftell(ctx->file);
-		pc   = c;
-		c    = fgetc(ctx->file);
-	    } while(!eof && c != '\n');
-	}
-    } while(!eof && bson_is_whitespace(c));
-    fseek(ctx->file, prev, SEEK_SET);
+    int c;
+    while((c = ctx_peek(ctx, 0)) != EOF) {
+	if(c == '/' && ctx_peek(ctx, 1) == '/') {
+	    do c = ctx_getc(ctx); while(c != EOF && c != '\n');
+	}
+	else if(bson_is_whitespace(c))
+	    ctx_getc(ctx);
+	else
+	    break;
+    }
     return BSON_SUCCESS;
 }
 
 static bsonenum check_pop(ReadContext *ctx) {
-    if(eof)
-	return BSON_SUCCESS;
-    uint64_t prev = ftell(ctx->file);
-    int popped = 0;
-    char c;
-    do {
-	c = fgetc(ctx->file);
-	if(c == '}') {
-	    popped = 1;
-	    break;
-	}
-    } while(!eof && !bson_is_whitespace(c));
-    if(!popped) {
-	fseek(ctx->file, prev, SEEK_SET);
+    if(ctx_peek(ctx, 0) != '}')
 	return BSON_SUCCESS;
-    }
-    ctx_pop(ctx);
+    ctx_getc(ctx);
+    bsonenum ret = ctx_pop(ctx);
+    if(ret != BSON_SUCCESS)
+	return ret;
     return BSON_CONTINUE;
 }
 
 static bsonenum read_left(ReadContext *ctx) {
-    if(eof)
-	return BSON_SUCCESS;
-    char c;
+    int c;
     uint64_t i = 0;
-    do {
-	c = fgetc(ctx->file);
-	ctx->left[i++] = c;
-	if(i >= ctx->leftmax) {
-	    void *tptr = bsonrealloc(ctx->left, (ctx->leftmax + MORE_LEFT));
-	    if(tptr == NULL)
-		return BSON_MEMORY;
-	    ctx->left = tptr;
-	}
-    } while(!eof && !bson_is_whitespace(c));
+    while((c = ctx_peek(ctx, 0)) != EOF && !bson_is_whitespace(c) && c != '=' && c != '{') {
+	ctx->left[i++] = ctx_getc(ctx);
+	if(i >= ctx->leftmax && ctx_grow(ctx, &ctx->left, &ctx->leftmax, MORE_LEFT) != BSON_SUCCESS)
+	    return BSON_MEMORY;
+    }
     ctx->left[i] = '\0';
-    bson_trim_string(ctx->left, ctx->left);
     return BSON_SUCCESS;
 }
 
@@ -355,7 +1092,7 @@ static bsonenum read_middle(ReadContext *ctx) {
     if(eof)
 	return BSON_SUCCESS;
     bsonenum ret;
-    char c = fgetc(ctx->file);
+    int c = ctx_getc(ctx);
     switch(c) {
 	case '{':
 	    ret = ctx_push(ctx);
@@ -370,30 +1107,75 @@ static bsonenum read_middle(ReadContext *ctx) {
     return BSON_SYNTAX;
 }
 
+/* A value ends at the end of its line, unless a [ or { is still open, so
+ * arrays (and arrays of records) may span lines. Comments are dropped. */
 static bsonenum read_right(ReadContext *ctx) {
-    if(eof)
-	return BSON_SUCCESS;
-    char c;
-    uint64_t i = 0;
-    do {
-	c = fgetc(ctx->file);
-	ctx->right[i++] = c;
-	if(i >= ctx->rightmax) {
-	    ctx->right = bsonrealloc(ctx->right, (ctx->rightmax += MORE_RIGHT));
-	    if(ctx->right == NULL)
-		return BSON_MEMORY;
+    int c, quoted = 0;
+    uint64_t i = 0, depth = 0;
+    while((c = ctx_getc(ctx)) != EOF) {
+	if(c == '"')
+	    quoted = !quoted;
+	else if(!quoted && c == '/' && ctx_peek(ctx, 0) == '/') {
+	    do c = ctx_getc(ctx); while(c != EOF && c != '\n');
+	    if(c == EOF)
+		break;
+	}
+	if(c == '\n') {
+	    if(depth == 0)
+		break;
+	    quoted = 0;
 	}
-    } while(!eof && c != '\n'); /* TODO: FIND A WAY FOR MULTI LINE DATA */
+	else if(!quoted && (c == '[' || c == '{'))
+	    depth++;
+	else if(!quoted && (c == ']' || c == '}') && depth > 0)
+	    depth--;
+	ctx->right[i++] = c;
+	if(i >= ctx->rightmax && ctx_grow(ctx, &ctx->right, &ctx->rightmax, MORE_RIGHT) != BSON_SUCCESS)
+	    return BSON_MEMORY;
+    }
     ctx->right[i] = '\0';
-    bson_trim_string(ctx->right, ctx->right);
+    if(i > 0)
+	bson_trim_string(ctx->right, ctx->right);
     return BSON_SUCCESS;
 }
 
-static void *get_strings(const char *src, bsonenum *type);
-static void *get_string(const char *src, bsonenum *type);
-static void *get_numbers(const char *src, bsonenum *type);
-static void *get_number(const char *src, bsonenum *type);
-static bsonenum add_element_to_bson(BSON *bson, ReadContext *ctx, void *data, bsonenum type);
+static void *get_strings(bsonintern *in, const char *src, bsonenum *type);
+static void *get_string(bsonintern *in, const char *src, bsonenum *type);
+static void *get_numbers(bsonarena *arena, const char *src, bsonenum *type);
+static void *get_number(bsonarena *arena, const char *src, bsonenum *type);
+static const char *skip_whitespace(const char *src);
+static bsonenum add_element_to_bson(BSON *bson, ReadContext *ctx, const char *field, uint64_t fieldlen, void *data, bsonenum type);
+
+typedef struct {
+    const char *name;
+    uint64_t    len;
+    bsonenum    type;
+    void       *data;
+} column_t;
+static bsonenum get_records(bsonintern *in, const char *src, column_t *cols, uint64_t maxcols, uint64_t *ncols);
+
+/* Each field of an array of records becomes its own element, key.field,
+ * holding that field for every record in order. */
+static bsonenum save_records(BSON *bson, ReadContext *ctx) {
+    uint64_t maxcols = 0, ncols = 0, i;
+    const char *cur;
+    int quoted = 0;
+    for(cur = ctx->right; *cur; cur++) {
+	if(*cur == '"')
+	    quoted = !quoted;
+	else if(*cur == '=' && !quoted)
+	    maxcols++;
+    }
+    column_t *cols = NULL;
+    if(maxcols > 0 && (cols = bsonarena_temp(ctx->arena, maxcols * sizeof(column_t))) == NULL)
+	return BSON_MEMORY;
+    bsonenum ret = get_records(&ctx->intern, ctx->right, cols, maxcols, &ncols);
+    for(i = 0; i < ncols && ret == BSON_SUCCESS; i++)
+	ret = add_element_to_bson(bson, ctx, cols[i].name, cols[i].len, cols[i].data, cols[i].type);
+    if(cols != NULL)
+	bsonarena_untemp(ctx->arena, cols, maxcols * sizeof(column_t));
+    return ret;
+}
 
 static bsonenum save_right(BSON *bson, ReadContext *ctx) {
     if(strlen(ctx->right) == 0)
@@ -401,84 +1183,193 @@ static bsonenum save_right(BSON *bson, ReadContext *ctx) {
     bsonenum   type;
     void    *data;
     switch(ctx->right[0]) {
-	case '[': {
-	    uint64_t i;
-	    int quotes = 0;
-	    for(i = 0; ctx->right[i]; i++) {
-		if(ctx->right[i] == '"') {
-		    quotes = 1;
-		    break;
-		}
-	    }
-	    data = quotes ?
-		   get_strings(ctx->right, &type) :
-		   get_numbers(ctx->right, &type);
-	} break;
+	case '[': 
+	    if(*skip_whitespace(ctx->right + 1) == '{')
+		return save_records(bson, ctx);
+	    data = strchr(ctx->right, '"') != NULL ?
+		   get_strings(&ctx->intern, ctx->right, &type) :
+		   get_numbers(ctx->arena, ctx->right, &type);
+	    break;
 	case '"':
-	    data = get_string(ctx->right, &type);
+	    data = get_string(&ctx->intern, ctx->right, &type);
 	    break;
 	default: 
-	    data = get_number(ctx->right, &type);
+	    data = get_number(ctx->arena, ctx->right, &type);
 	    break;
     }
     if(data == NULL)
-	return BSON_SYNTAX;
-    return add_element_to_bson(bson, ctx, data, type);
+	return type == BSON_MEMORY ? BSON_MEMORY : BSON_SYNTAX;
+    return add_element_to_bson(bson, ctx, NULL, 0, data, type);
 }
 
 
-static bsonenum add_element_to_bson(BSON *bson, ReadContext *ctx, void *data, bsonenum type) {
-    char *name;
-    if(strlen(ctx->stack) == 0) {
-	name = bsonstrdup(ctx->left);
-	if(name == NULL)
-	    return BSON_MEMORY;
+/* Squeezes a number array down in place, handing the tail back to the
+ * arena when it was the last thing allocated. Returns the new width. */
+static uint8_t narrow_value(BSON *bson, void *data, bsonenum type) {
+    size_t len = *((size_t *)(data));
+    void  *at  = (size_t *)(data) + 1;
+    int width = type == BSON_INT ?
+		bson_narrow_width_int(at, len) :
+		bson_narrow_width_dbl(at, len);
+    if(width == 8)
+	return 0;
+    if(type == BSON_INT)
+	bson_narrow_int(at, at, width, len);
+    else
+	bson_narrow_dbl(at, at, width, len);
+    bsonarena_trim(&bson->arena, data, sizeof(size_t) + len * 8, sizeof(size_t) + len * width);
+    bson->narrowsaved += len * (8 - width);
+    return width;
+}
+
+/* Taken before narrowing, so a value hashes the same in any width */
+static uint64_t value_hash(bsonenum type, const void *data) {
+    size_t len = *((const size_t *)(data)), i;
+    const void *items = (const size_t *)(data) + 1;
+    if(type != BSON_STR)
+	return bson_hash_len((const char *)(items), len * sizeof(long long)) ^ type;
+    uint64_t h = len;
+    for(i = 0; i < len; i++) {
+	h = (h ^ bson_hash(((char *const *)(items))[i])) * 0xC6A4A7935BD1E995ULL;
+	h ^= h >> 47;
     }
-    else {
-	name = bsonmalloc(strlen(ctx->stack) + strlen(ctx->left) + 2);
-	if(name == NULL)
-	    return BSON_MEMORY;
-	strcpy(name, ctx->stack);
-	name[strlen(name)]     =  '.';
-	name[strlen(name) + 1] = '\0';
-	strcat(name, ctx->left);
+    return h ^ type;
+}
+
+/* Fingerprints are sums of these, so they do not depend on order and a
+ * replaced value is simply taken out again */
+static uint64_t entry_fingerprint(const element_t *e) {
+    uint64_t h = e->hash ^ (e->vhash * 0xC6A4A7935BD1E995ULL);
+    h ^= h >> 47;
+    h *= 0xC6A4A7935BD1E995ULL;
+    h ^= h >> 47;
+    return h;
+}
+
+/* Paths come out of the document's own arena, the interner only hands
+ * them out const */
+static void add_fingerprint(BSON *bson, const bsonpath *path, uint64_t fingerprint) {
+    bson->fingerprint += fingerprint;
+    for(; path != NULL; path = path->parent)
+	((bsonpath *)(path))->fingerprint += fingerprint;
+}
+
+static void link_entry(BSON *bson, element_t *e) {
+    element_t **first = e->path == NULL ? &bson->topentries : (element_t **)(&((bsonpath *)(e->path))->entries);
+    e->sibling = *first;
+    *first = e;
+}
+
+/* Without maxkeys the table doubles whenever it holds more keys than
+ * buckets. The old one stays in the arena, which the doubling keeps below
+ * the size of the final table. Chains keep their order. Failing to grow
+ * only leaves the chains longer. */
+static void grow_elements(BSON *bson) {
+    uint64_t max = bson->elementsmax * 2, i;
+    element_t **elements = bsonarena_calloc(&bson->arena, max * sizeof(element_t *), sizeof(element_t *));
+    if(elements == NULL)
+	return;
+    for(i = 0; i < bson->elementsmax; i++) {
+	element_t *cur = bson->elements[i], *next, **link;
+	for(; cur != NULL; cur = next) {
+	    next = cur->next;
+	    cur->next = NULL;
+	    for(link = &elements[cur->hash % max]; *link != NULL; link = &(*link)->next);
+	    *link = cur;
+	}
     }
+    bson->elements    = elements;
+    bson->elementsmax = max;
+}
 
-    element_t *e = bsoncalloc(1, sizeof(element_t));
-    if(e == NULL) {
-	bsonfree(name);
+/* The name is stack.left, or stack.left.field for a column of records.
+ * It is spelled out in a temporary only to hash it; the element keeps
+ * its scope and the interned leaf. */
+static bsonenum add_element_to_bson(BSON *bson, ReadContext *ctx, const char *field, uint64_t fieldlen, void *data, bsonenum type) {
+    uint8_t narrow = 0;
+    uint64_t vhash = bson->visit == NULL ? value_hash(type, data) : 0;
+    if((bson->flags & BSON_OPT_COMPACT) && bson->visit == NULL && (type == BSON_INT || type == BSON_DBL))
+	narrow = narrow_value(bson, data, type);
+    uint64_t stacklen = strlen(ctx->stack), leftlen = strlen(ctx->left), at = 0;
+    uint64_t namesize = stacklen + leftlen + fieldlen + 3;
+    char *name = bsonarena_temp(ctx->arena, namesize);
+    if(name == NULL)
 	return BSON_MEMORY;
+    if(ctx->scope != NULL) {
+	memcpy(name, ctx->stack, stacklen);
+	name[stacklen] = '.';
+	at = stacklen + 1;
     }
-    
-    e->name = name;
-    e->data = data;
-    e->type = type;
+    memcpy(name + at, ctx->left, leftlen);
+    at += leftlen;
+    if(field != NULL) {
+	name[at++] = '.';
+	memcpy(name + at, field, fieldlen);
+	at += fieldlen;
+    }
+    name[at] = '\0';
 
-    uint64_t loc = bson_hash(e->name) % bson->elementsmax;
-    // printf(" >> GOING TO LOCATION (%lu)\n", loc);
-    if(bson->elements[loc] == NULL) {
-	bson->elements[loc] = e;
+    uint64_t hash = bson_hash(name);
+    if(bson->visit != NULL) {
+	bson->visit(name, hash, type, (size_t *)(data) + 1, bson->visitud);
+	bsonarena_untemp(ctx->arena, name, namesize);
 	return BSON_SUCCESS;
     }
-    
-    element_t *cur = bson->elements[loc];
-    while(cur != NULL) {
-	if(strcmp(cur->name, e->name) == 0) {
-	    bsonfree(cur->name);
-	    bsonfree(cur->data);
-	    cur->name = e->name;
-	    cur->data = e->data;
-	    cur->type = e->type;
-	    bsonfree(e);
-	    return BSON_SUCCESS;
-	}
-	if(cur->next == NULL) {
-	    cur->next = e;
+    uint64_t loc = hash % bson->elementsmax;
+    element_t **link = &bson->elements[loc];
+    /* Replacing just repoints, the old value stays in the arena */
+    while(*link != NULL) {
+	if((*link)->hash == hash && name_matches(*link, name)) {
+	    bsonarena_untemp(ctx->arena, name, namesize);
+	    add_fingerprint(bson, (*link)->path, -entry_fingerprint(*link));
+	    (*link)->data   = data;
+	    (*link)->type   = type;
+	    (*link)->narrow = narrow;
+	    (*link)->vhash  = vhash;
+	    add_fingerprint(bson, (*link)->path, entry_fingerprint(*link));
 	    return BSON_SUCCESS;
 	}
-	cur = cur->next;
+	link = &(*link)->next;
     }
+    bsonarena_untemp(ctx->arena, name, namesize);
 
+    if(bson->maxkeys > 0 && bson->count >= bson->maxkeys)
+	return BSON_MEMORY;
+    /* Dots in the key open scopes like braces would */
+    const bsonpath *path = ctx->scope;
+    const char     *rest = ctx->left, *dot;
+    uint64_t        restlen = leftlen;
+    int             ok = 1;
+    if(field != NULL) {
+	ok = (path = bson_intern_dotted(&ctx->intern, path, ctx->left, leftlen)) != NULL;
+	rest    = field;
+	restlen = fieldlen;
+    }
+    if(ok && (dot = memrchr(rest, '.', restlen)) != NULL) {
+	ok = (path = bson_intern_dotted(&ctx->intern, path, rest, dot - rest)) != NULL;
+	restlen -= dot - rest + 1;
+	rest     = dot + 1;
+    }
+    const char *leaf = ok ? bson_intern_str(&ctx->intern, rest, restlen) : NULL;
+    element_t *e = leaf == NULL ? NULL : bsonarena_calloc(ctx->arena, sizeof(element_t), sizeof(void *));
+    if(e == NULL)
+	return BSON_MEMORY;
+    /* Against a full name per key, which needed no leaf pointer */
+    ctx->intern.wanted += at + 1;
+    ctx->intern.copied += sizeof(void *);
+    e->path = path;
+    e->leaf = leaf;
+    e->data = data;
+    e->hash = hash;
+    e->type = type;
+    e->narrow = narrow;
+    e->vhash = vhash;
+    *link = e;
+    link_entry(bson, e);
+    add_fingerprint(bson, path, entry_fingerprint(e));
+    bson->count++;
+    if(bson->maxkeys == 0 && !bson->arena.fixed && bson->count > bson->elementsmax)
+	grow_elements(bson);
     return BSON_SUCCESS;
 }
 
@@ -487,280 +1378,957 @@ static bsonenum add_element_to_bson(BSON *bson, ReadContext *ctx, void *data, bs
 
 /*    PARSING    */
 
-
-static void *get_strings(const char *src, bsonenum *type) {
-    const char *first = src + 1;
-    while(*first && bson_is_whitespace(*first))
-	first++;
-    if(*first != '"') {
-	*type = BSON_SYNTAX;
-	return NULL;
-    }
-
-    uint64_t i = strlen(first) - 1, last;
-    int valid = 0;
-    while(i != 0) {
-	if(first[i] == ']') {
-	    valid = 1;
-	    break;
-	}
-	i--;
-    }
-    last = i;
-    if(!valid) {
-	*type = BSON_SYNTAX;
+/* Values are a size_t length followed by the items. Arrays get counted
+ * before anything is allocated, so every value is exactly one arena
+ * allocation (plus one per string) and parsing is linear in the line. */
+/* The length sits just before a BSON_ALIGN boundary for arrays long
+ * enough to fill a vector, so the copy kernels start on aligned loads. */
+static void *new_value(bsonarena *arena, uint64_t len, uint64_t itemsize) {
+    uint64_t pad = len >= 4 ? BSON_ALIGN - sizeof(size_t) : 0;
+    char *base = bsonarena_alloc(arena, pad + sizeof(size_t) + len * itemsize, pad ? BSON_ALIGN : sizeof(size_t));
+    if(base == NULL)
 	return NULL;
-    }
-    
-    first++; /* We know the first char is a quote */
-    uint64_t datamax = sizeof(char *) * MORE_ARRAY + sizeof(size_t);
-    uint64_t datalen = 0;
-    void    *data = bsonmalloc(datamax);
-    char   **strs = (char **)((size_t *)(data) + 1);
-    uint64_t stringmax;
-    char *string;
-#define MORE_STRING 64
-    while(*first) {
-	i = 0;
-	stringmax = MORE_STRING;
-	string = bsoncalloc(stringmax, 1);
-	valid = 0;
-	while(*first && *first != '"') {
-	    string[i] = *first;
-	    i++;
-	    if(i >= stringmax) {
-		void *tptr = bsonrealloc(string, (stringmax += MORE_STRING));
-		if(tptr == NULL) {
-		    bsonfree(string);
-		    bson_free_inner_strings(data);
-		    bsonfree(data);
-		    *type = BSON_MEMORY;
-		    return NULL;
-		}
-		string = tptr;
-	    }
+    size_t *data = (size_t *)(base + pad);
+    *data = len;
+    return data;
+}
 
-	    first++;
-	}
-	/* Since calloc, we good */
-	strs[datalen++] = string;
-	if(datalen >= datamax) {
-	    void *tptr = bsonrealloc(data, (datamax += MORE_ARRAY * sizeof(char *)));
-	    if(tptr == NULL) {
-		bson_free_inner_strings(data);
-		bsonfree(data);
-		*type = BSON_MEMORY;
-		return NULL;
-	    }
-	    data = tptr;
-	    strs = (char **)((size_t *)(data) + 1);
-	}
+static const char *skip_whitespace(const char *src) {
+    while(bson_is_whitespace(*src))
+	src++;
+    return src;
+}
 
+/* Equal strings anywhere in the document share one copy */
+static char *copy_string(bsonintern *in, const char *src, uint64_t len) {
+    in->wanted += len + 1;
+    return (char *)(bson_intern_str(in, src, len));
+}
 
-	first++;
-	while(bson_is_whitespace(*first))
-	    first++;
-	if(*first == ']')
-	    break;
-	if(*first != ',') {
-	    bson_free_inner_strings(data);
+static void *get_strings(bsonintern *in, const char *src, bsonenum *type) {
+    const char *cur, *end;
+    uint64_t len = 0, i;
+    for(cur = src + 1;; len++) {
+	cur = skip_whitespace(cur);
+	if(*cur != '"' || (end = strchr(cur + 1, '"')) == NULL) {
 	    *type = BSON_SYNTAX;
 	    return NULL;
 	}
-	
-	do first++; while(bson_is_whitespace(*first));
-	if(*first != '"') {
-	    bson_free_inner_strings(data);
-	    bsonfree(data);
+	cur = skip_whitespace(end + 1);
+	if(*cur == ']')
+	    break;
+	if(*cur++ != ',') {
 	    *type = BSON_SYNTAX;
 	    return NULL;
 	}
-	first++;
+    }
+    len++;
+
+    void *data = new_value(in->arena, len, sizeof(char *));
+    if(data == NULL) {
+	*type = BSON_MEMORY;
+	return NULL;
+    }
+    char **strs = (char **)((size_t *)(data) + 1);
+    for(cur = src + 1, i = 0; i < len; i++) {
+	cur = skip_whitespace(cur) + 1;
+	end = strchr(cur, '"');
+	strs[i] = copy_string(in, cur, end - cur);
+	if(strs[i] == NULL) {
+	    *type = BSON_MEMORY;
+	    return NULL;
+	}
+	cur = skip_whitespace(end + 1) + 1;
     }
     
     *type = BSON_STR;
-    *((size_t *)(data)) = datalen;
     return data;
 }
 
-static void *get_string(const char *src, bsonenum *type) {
+static void *get_string(bsonintern *in, const char *src, bsonenum *type) {
     const char *first = src + 1;
-    uint64_t i = strlen(src) - 1, last;
-    int valid = 0;
-    while(i != 0) {
-	if(first[i] == '"') {
-	    valid = 1;
-	    last = i;
-	    break;
-	}
-	i--;
-    }
-    last = i;
-
-    if(!valid) {
+    const char *last = strrchr(first, '"');
+    if(last == NULL) {
 	*type = BSON_SYNTAX;
 	return NULL;
     }
     
-    char **data = bsonmalloc(sizeof(char *) + sizeof(size_t));
+    void *data = new_value(in->arena, 1, sizeof(char *));
     if(data == NULL) {
 	*type = BSON_MEMORY;
 	return NULL;
     }
-   
-    *((size_t *)(data)) = 1;
     char **start = (char **)((size_t *)(data) + 1);
-    (*start) = bsonmalloc(last + 2);
-
-    for(i = 0; i < last; i++)
-	start[0][i] = first[i];
-    start[0][i] = '\0';
-
+    *start = copy_string(in, first, last - first);
+    if(*start == NULL) {
+	*type = BSON_MEMORY;
+	return NULL;
+    }
     *type = BSON_STR;
-    return (void *)data;
+    return data;
 }
     
 union number { long long d; double f; };
-static void *get_numbers(const char *src, bsonenum *type) {
-    const char *first = src + 1;
-    while(*first && bson_is_whitespace(*first))
-	first++;
-
-    uint64_t i = strlen(first) - 1, last;
-    int valid = 0;
-    while(i != 0) {
-	if(first[i] == ']') {
-	    valid = 1;
-	    break;
-	}
-	i--;
+
+/* Integer unless it has a decimal point, which makes it a double */
+static const char *get_one_number(const char *src, union number *num, bsonenum *type) {
+    char *end;
+    num->d = strtoll(src, &end, 10);
+    if(end == src)
+	return NULL;
+    if(*end == '.' || *type == BSON_DBL) {
+	if(*type == BSON_INT)
+	    return NULL;
+	num->f = strtod(src, &end);
+	*type = BSON_DBL;
     }
-    last = i;
-    if(!valid) {
+    return end;
+}
+
+static void *get_numbers(bsonarena *arena, const char *src, bsonenum *type) {
+    const char *cur;
+    uint64_t len = 1, i;
+    for(cur = src + 1; *cur && *cur != ']'; cur++) {
+	if(*cur == ',')
+	    len++;
+    }
+    if(*cur != ']') {
 	*type = BSON_SYNTAX;
 	return NULL;
     }
 
-    uint64_t datamax = sizeof(long long) * MORE_ARRAY + sizeof(size_t);
-    uint64_t datalen = 0;
-    void *data = bsonmalloc(datamax);
+    void *data = new_value(arena, len, sizeof(union number));
+    if(data == NULL) {
+	*type = BSON_MEMORY;
+	return NULL;
+    }
     union number *start = (union number *)((size_t *)(data) + 1);
     
-    char *end;
-    *type = BSON_INT;
-    start[datalen].d = strtoll(first, &end, 10);
-    if(first == end) {
-	bsonfree(data);
+    *type = BSON_MAX;
+    for(cur = src + 1, i = 0; i < len; i++) {
+	cur = get_one_number(skip_whitespace(cur), &start[i], type);
+	if(cur == NULL) {
+	    *type = BSON_SYNTAX;
+	    return NULL;
+	}
+	cur = skip_whitespace(cur);
+	if(*cur != (i == len - 1 ? ']' : ',')) {
+	    *type = BSON_SYNTAX;
+	    return NULL;
+	}
+	cur++;
+	if(*type == BSON_MAX)
+	    *type = BSON_INT;
+    }
+    return data;
+}
+
+static void *get_number(bsonarena *arena, const char *src, bsonenum *type) {
+    union number intdbl;
+    *type = BSON_MAX;
+    if(get_one_number(src, &intdbl, type) == NULL) {
 	*type = BSON_SYNTAX;
 	return NULL;
     }
-    if(*end == '.') {
-	start[datalen].f = strtof(first, &end);
-	*type = BSON_DBL;
-	if(first == end) {
-	    bsonfree(data);
-	    *type = BSON_SYNTAX;
+    if(*type == BSON_MAX)
+	*type = BSON_INT;
+
+    void *data = new_value(arena, 1, sizeof(intdbl));
+    if(data == NULL) {
+	*type = BSON_MEMORY;
+	return NULL;
+    }
+    memcpy((size_t *)(data) + 1, &intdbl, sizeof(intdbl));
+    return data;
+}
+
+/* One name = value pair of a record. Fills in the column's name and the
+ * value's type, returns where the value starts and sets *end past it. */
+static const char *get_field(const char *src, column_t *field, const char **end) {
+    const char *cur = src;
+    while(*cur && !bson_is_whitespace(*cur) && *cur != '=' && *cur != '}' && *cur != ',')
+	cur++;
+    field->name = src;
+    field->len  = cur - src;
+    cur = skip_whitespace(cur);
+    if(field->len == 0 || *cur != '=')
+	return NULL;
+    const char *value = skip_whitespace(cur + 1);
+    char *numend;
+    if(*value == '"') {
+	if((*end = strchr(value + 1, '"')) == NULL)
 	    return NULL;
+	(*end)++;
+	field->type = BSON_STR;
+	return value;
+    }
+    strtoll(value, &numend, 10);
+    if(numend == value)
+	return NULL;
+    field->type = BSON_INT;
+    if(*numend == '.') {
+	strtod(value, &numend);
+	field->type = BSON_DBL;
+    }
+    *end = numend;
+    return value;
+}
+
+static const char *skip_separators(const char *src) {
+    while(bson_is_whitespace(*src) || *src == ',')
+	src++;
+    return src;
+}
+
+/* Two walks over the records: the first collects the fields and their
+ * types (an integer column with a decimal in it becomes a double column)
+ * and counts the records, the second fills the columns. Fields missing
+ * from a record read as 0, 0.0 or "". */
+static bsonenum walk_records(bsonintern *in, const char *src, column_t *cols, uint64_t maxcols, uint64_t *ncols, uint64_t *records, int fill) {
+    const char *cur = src + 1, *value, *end;
+    uint64_t    record = 0, i;
+    column_t    field;
+    for(;; record++) {
+	cur = skip_separators(cur);
+	if(*cur == ']')
+	    break;
+	if(*cur++ != '{')
+	    return BSON_SYNTAX;
+	for(;;) {
+	    cur = skip_separators(cur);
+	    if(*cur == '}') {
+		cur++;
+		break;
+	    }
+	    if((value = get_field(cur, &field, &end)) == NULL)
+		return BSON_SYNTAX;
+	    cur = end;
+	    for(i = 0; i < *ncols; i++) {
+		if(cols[i].len == field.len && memcmp(cols[i].name, field.name, field.len) == 0)
+		    break;
+	    }
+	    if(fill) {
+		void *at = (size_t *)(cols[i].data) + 1;
+		if(cols[i].type == BSON_STR)
+		    ((char **)(at))[record] = copy_string(in, value + 1, end - value - 2);
+		else if(cols[i].type == BSON_DBL)
+		    ((double *)(at))[record] = strtod(value, NULL);
+		else
+		    ((long long *)(at))[record] = strtoll(value, NULL, 10);
+		if(cols[i].type == BSON_STR && ((char **)(at))[record] == NULL)
+		    return BSON_MEMORY;
+		continue;
+	    }
+	    if(i == *ncols) {
+		if(*ncols == maxcols)
+		    return BSON_SYNTAX;
+		cols[(*ncols)++] = field;
+	    }
+	    else if((cols[i].type == BSON_STR) != (field.type == BSON_STR))
+		return BSON_SYNTAX;
+	    else if(field.type == BSON_DBL)
+		cols[i].type = BSON_DBL;
 	}
     }
-    datalen++;
+    *records = record;
+    return BSON_SUCCESS;
+}
 
-    while(bson_is_whitespace(*end))
-	end++;
-    
-    if(*end == ']')
-	goto done; /* LMAO */
-    if(*end != ',') {
-	bsonfree(data);
-	*type = BSON_SYNTAX;
+static bsonenum get_records(bsonintern *in, const char *src, column_t *cols, uint64_t maxcols, uint64_t *ncols) {
+    uint64_t records, i, j;
+    *ncols = 0;
+    bsonenum ret = walk_records(in, src, cols, maxcols, ncols, &records, 0);
+    if(ret != BSON_SUCCESS)
+	return ret;
+    for(i = 0; i < *ncols; i++) {
+	cols[i].data = new_value(in->arena, records, sizeof(union number));
+	if(cols[i].data == NULL)
+	    return BSON_MEMORY;
+	memset((size_t *)(cols[i].data) + 1, 0, records * sizeof(union number));
+	if(cols[i].type == BSON_STR) {
+	    char **strs = (char **)((size_t *)(cols[i].data) + 1);
+	    char  *none = copy_string(in, "", 0);
+	    if(none == NULL)
+		return BSON_MEMORY;
+	    for(j = 0; j < records; j++)
+		strs[j] = none;
+	}
+    }
+    return walk_records(in, src, cols, maxcols, ncols, &records, 1);
+}
+
+/*               */
+
+
+/*   INCLUDES    */
+
+/* include "path" pulls in a fragment: its keys land under the scope the
+ * directive sits in, as if its text were pasted there. Fragments are
+ * parsed once per process and kept, keyed by path, size and mtime, so a
+ * file shared by many documents costs a copy of its values per include.
+ * Relative paths start from the including file's directory. */
+typedef struct {
+    char      *name;
+    bsonenum   type;
+    void      *items;
+} fragentry_t;
+
+typedef struct {
+    char            *path;
+    off_t            size;
+    struct timespec  mtime;
+} fragfile_t;
+
+typedef struct _s_fragment_t {
+    fragfile_t      *files;   /* Its own file first, then what it included */
+    uint64_t         nfiles;
+    uint64_t         maxfiles;
+    BSON            *doc;     /* Owns the values, opened with a visitor */
+    fragentry_t     *entries; /* In file order, so later ones still win */
+    uint64_t         count;
+    uint64_t         max;
+    uint64_t         refs;    /* One while cached, one per splice running */
+    int              failed;
+    struct _s_fragment_t *next;
+} fragment_t;
+
+static struct {
+    pthread_mutex_t  lock;
+    fragment_t      *head;
+} fragments = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* Fragments including fragments, on this thread; stops include cycles */
+static __thread int including;
+
+static void free_fragment(fragment_t *f) {
+    uint64_t i;
+    for(i = 0; i < f->count; i++)
+	bsonfree(f->entries[i].name);
+    if(f->entries != NULL)
+	bsonfree(f->entries);
+    if(f->doc != NULL)
+	bson_free(&f->doc, NULL);
+    for(i = 0; i < f->nfiles; i++)
+	bsonfree(f->files[i].path);
+    if(f->files != NULL)
+	bsonfree(f->files);
+    bsonfree(f);
+}
+
+static int add_file(fragment_t *f, const char *path, off_t size, struct timespec mtime) {
+    if(f->nfiles == f->maxfiles) {
+	uint64_t max = f->maxfiles ? f->maxfiles * 2 : 4;
+	fragfile_t *more = bsonrealloc(f->files, max * sizeof(fragfile_t));
+	if(more == NULL)
+	    return 0;
+	f->files    = more;
+	f->maxfiles = max;
+    }
+    fragfile_t *file = &f->files[f->nfiles];
+    if((file->path = bsonstrdup(path)) == NULL)
+	return 0;
+    file->size  = size;
+    file->mtime = mtime;
+    f->nfiles++;
+    return 1;
+}
+
+/* A fragment is only as fresh as every file that went into it */
+static int fragment_fresh(const fragment_t *f) {
+    struct stat st;
+    uint64_t i;
+    for(i = 0; i < f->nfiles; i++) {
+	const fragfile_t *file = &f->files[i];
+	if(stat(file->path, &st) != 0 || st.st_size != file->size ||
+	   st.st_mtim.tv_sec != file->mtime.tv_sec || st.st_mtim.tv_nsec != file->mtime.tv_nsec)
+	    return 0;
+    }
+    return 1;
+}
+
+/* Called with the lock held */
+static void drop_fragment(fragment_t *f) {
+    if(--f->refs == 0)
+	free_fragment(f);
+}
+
+static void collect_entry(const char *name, uint64_t hash, bsonenum type, void *items, void *ud) {
+    fragment_t *f = ud;
+    if(f->failed)
+	return;
+    if(f->count == f->max) {
+	uint64_t max = f->max ? f->max * 2 : MAX_ELEMENTS;
+	fragentry_t *more = bsonrealloc(f->entries, max * sizeof(fragentry_t));
+	if(more == NULL) {
+	    f->failed = 1;
+	    return;
+	}
+	f->entries = more;
+	f->max     = max;
+    }
+    fragentry_t *e = &f->entries[f->count];
+    if((e->name = bsonstrdup(name)) == NULL) {
+	f->failed = 1;
+	return;
+    }
+    e->type  = type;
+    e->items = items;
+    f->count++;
+}
+
+static fragment_t *load_fragment(const char *path, const struct stat *st, bsonenum *result) {
+    fragment_t *f = bsoncalloc(1, sizeof(fragment_t));
+    if(f == NULL || !add_file(f, path, st->st_size, st->st_mtim)) {
+	if(f != NULL)
+	    free_fragment(f);
+	*result = BSON_MEMORY;
+	return NULL;
+    }
+    bsonopts opts;
+    memset(&opts, 0, sizeof(bsonopts));
+    opts.visit   = collect_entry;
+    opts.visitud = f;
+    f->doc = bson_open_opts(path, &opts, result);
+    if(f->doc == NULL || f->failed) {
+	if(f->failed)
+	    *result = BSON_MEMORY;
+	free_fragment(f);
+	return NULL;
+    }
+    return f;
+}
+
+/* The cached fragment for path, parsing it when it is new or one of its
+ * files changed. The caller holds a reference until put_fragment(). Two
+ * threads missing at once both parse; the later one replaces the other. */
+static fragment_t *get_fragment(const char *path, int *hit, bsonenum *result) {
+    fragment_t **link, *f;
+    pthread_mutex_lock(&fragments.lock);
+    for(f = fragments.head; f != NULL; f = f->next) {
+	if(strcmp(f->files[0].path, path) == 0 && fragment_fresh(f)) {
+	    f->refs++;
+	    pthread_mutex_unlock(&fragments.lock);
+	    *hit = 1;
+	    return f;
+	}
+    }
+    pthread_mutex_unlock(&fragments.lock);
+
+    struct stat st;
+    if(stat(path, &st) != 0) {
+	*result = BSON_FILE_PATH;
 	return NULL;
     }
 
-    do end++; while(bson_is_whitespace(*end));
+    *hit = 0;
+    if(including >= MAX_INCLUDES) {
+	*result = BSON_INVALID_VALUE;
+	return NULL;
+    }
+    including++;
+    f = load_fragment(path, &st, result);
+    including--;
+    if(f == NULL)
+	return NULL;
 
-    while(*end) {
-	first = end;
-	if(*type == BSON_DBL)
-	    start[datalen].f = strtod(first, &end);
+    pthread_mutex_lock(&fragments.lock);
+    for(link = &fragments.head; *link != NULL;) {
+	fragment_t *old = *link;
+	if(strcmp(old->files[0].path, path) == 0) {
+	    *link = old->next;
+	    drop_fragment(old);
+	}
 	else
-	    start[datalen].d = strtoll(first, &end, 10);
-	datalen++;
-	if(datalen >= datamax) {
-	    void *tptr = realloc(data, (datamax += sizeof(long long) * MORE_ARRAY));
-	    if(tptr == NULL) {
-		bsonfree(data);
-		*type = BSON_MEMORY;
+	    link = &old->next;
+    }
+    f->refs = 2;
+    f->next = fragments.head;
+    fragments.head = f;
+    pthread_mutex_unlock(&fragments.lock);
+    return f;
+}
+
+static void put_fragment(fragment_t *f) {
+    pthread_mutex_lock(&fragments.lock);
+    drop_fragment(f);
+    pthread_mutex_unlock(&fragments.lock);
+}
+
+void bson_include_flush(void) {
+    pthread_mutex_lock(&fragments.lock);
+    while(fragments.head != NULL) {
+	fragment_t *f = fragments.head;
+	fragments.head = f->next;
+	drop_fragment(f);
+    }
+    pthread_mutex_unlock(&fragments.lock);
+}
+
+static char *include_path(const char *filename, const char *path) {
+    const char *slash = strrchr(filename, '/');
+    if(path[0] == '/' || slash == NULL)
+	return bsonstrdup(path);
+    uint64_t dirlen = slash - filename + 1, len = strlen(path);
+    char *full = bsonmalloc(dirlen + len + 1);
+    if(full == NULL)
+	return NULL;
+    memcpy(full, filename, dirlen);
+    memcpy(full + dirlen, path, len + 1);
+    return full;
+}
+
+/* Each include gets its own copy of the values, in the including arena,
+ * so narrowing, relayout and shared memory treat them like parsed ones */
+static void *copy_included(bsonintern *in, bsonenum type, void *items) {
+    size_t len = bson_len(items), i;
+    void *data = new_value(in->arena, len, sizeof(union number));
+    if(data == NULL)
+	return NULL;
+    memcpy((size_t *)(data) + 1, items, len * sizeof(union number));
+    if(type == BSON_STR) {
+	char **strs = (char **)((size_t *)(data) + 1);
+	for(i = 0; i < len; i++) {
+	    if((strs[i] = copy_string(in, strs[i], strlen(strs[i]))) == NULL)
 		return NULL;
-	    }
-	    data = tptr;
 	}
+    }
+    return data;
+}
 
-	if(first == end || *end == '.') {
-	    bsonfree(data);
-	    *type = BSON_SYNTAX;
-	    return NULL;
+/* A fragment key goes in whole as the left side, so a.b in the fragment
+ * becomes stack.a.b with a.b as its leaf */
+static bsonenum splice_fragment(BSON *bson, ReadContext *ctx, const fragment_t *f) {
+    uint64_t i, len;
+    for(i = 0; i < f->count; i++) {
+	const fragentry_t *e = &f->entries[i];
+	len = strlen(e->name);
+	while(len >= ctx->leftmax) {
+	    if(ctx_grow(ctx, &ctx->left, &ctx->leftmax, MORE_LEFT) != BSON_SUCCESS)
+		return BSON_MEMORY;
 	}
-	
-	while(bson_is_whitespace(*end))
-	    end++;
-	
-	if(*end == ']')
-	    break;
+	memcpy(ctx->left, e->name, len + 1);
+	void *data = copy_included(&ctx->intern, e->type, e->items);
+	if(data == NULL)
+	    return BSON_MEMORY;
+	bsonenum ret = add_element_to_bson(bson, ctx, NULL, 0, data, e->type);
+	if(ret != BSON_SUCCESS)
+	    return ret;
+    }
+    return BSON_SUCCESS;
+}
 
-	if(*end != ',') {
-	    bsonfree(data);
-	    *type = BSON_SYNTAX;
-	    return NULL;
-	}
-	
-	do end++; while(bson_is_whitespace(*end));
+/* Only include followed by a quoted path on the same line; a key called
+ * include still works with = or { */
+static bsonenum read_include(BSON *bson, ReadContext *ctx) {
+    if(ctx_peek(ctx, 0) != '"' || strcmp(ctx->left, "include") != 0)
+	return BSON_SUCCESS;
+    /* Fragments are parsed and cached on the heap */
+    if(ctx->arena->fixed)
+	return BSON_INVALID_VALUE;
+    bsonenum ret = read_right(ctx);
+    if(ret != BSON_SUCCESS)
+	return ret;
+    uint64_t len = strlen(ctx->right);
+    if(len < 3 || ctx->right[len - 1] != '"' || memchr(ctx->right + 1, '"', len - 2) != NULL)
+	return BSON_SYNTAX;
+    ctx->right[len - 1] = '\0';
+    char *path = include_path(bson->filename, ctx->right + 1);
+    if(path == NULL)
+	return BSON_MEMORY;
+    int hit;
+    fragment_t *f = get_fragment(path, &hit, &ret);
+    bsonfree(path);
+    if(f == NULL)
+	return ret;
+    bson->includes++;
+    bson->includehits += hit;
+    /* Inside a fragment being loaded, remember what it depends on */
+    uint64_t i;
+    if(bson->visit == collect_entry) {
+	fragment_t *outer = bson->visitud;
+	for(i = 0; i < f->nfiles && !outer->failed; i++)
+	    outer->failed = !add_file(outer, f->files[i].path, f->files[i].size, f->files[i].mtime);
     }
+    ret = splice_fragment(bson, ctx, f);
+    put_fragment(f);
+    return ret == BSON_SUCCESS ? BSON_CONTINUE : ret;
+}
+
+/*               */
 
-done:
-    *((size_t *)(union intdbl *)(data)) = datalen;
+
+/* SHARED MEMORY */
+
+/* A published segment is this header followed by a fixed arena holding a
+ * deep copy of the document, BSON struct included. Pointers inside are
+ * absolute for the publisher's mapping; attaching at that same address
+ * makes them valid as they are, anywhere else they get relocated by the
+ * distance between the two mappings in a private copy-on-write mapping. */
+#define SHM_MAGIC    0x314D48534E4F5342ULL /* "BSONSHM1" */
+#define SHM_ALIGN    64
+
+typedef struct {
+    uint64_t   magic;
+    uint64_t   size;
+    uintptr_t  base;
+    uint64_t   offset;
+} shmheader;
+
+static void *clone_value(bsonintern *in, const element_t *e) {
+    size_t len = *((size_t *)(e->data)), i;
+    size_t width = e->narrow ? e->narrow : sizeof(union number);
+    void *data = new_value(in->arena, len, width);
+    if(data == NULL)
+	return NULL;
+    memcpy(data, e->data, sizeof(size_t) + len * width);
+    if(e->type == BSON_STR) {
+	char **strs = (char **)((size_t *)(data) + 1);
+	for(i = 0; i < len; i++) {
+	    strs[i] = copy_string(in, strs[i], strlen(strs[i]));
+	    if(strs[i] == NULL)
+		return NULL;
+	}
+    }
     return data;
 }
 
-static void *get_number(const char *src, bsonenum *type) {
-    union number intdbl;
-	
-    char *end;
-    char *target;
-    uint64_t i = strlen(src), last;
-    while(bson_is_whitespace(src[i]) && i != 0)
-	i--;
-    last = i;
-    
-    target = bsonmalloc(last);
-    for(i = 0; i < last; i++)
-	target[i] = src[i];
-    target[i] = '\0';
-    
-    
-    intdbl.d = strtoll(target, &end, 10);
-    *type = BSON_INT;
-    if(target == end) {
-	bsonfree(target);
-	*type = BSON_SYNTAX;
+/* Re-interned into the copy, so sharing survives publishing */
+static const bsonpath *clone_path(bsonintern *in, const bsonpath *src, int *ok) {
+    if(src == NULL)
+	return NULL;
+    const bsonpath *parent = clone_path(in, src->parent, ok);
+    const bsonpath *path = bson_intern_path(in, parent, src->segment, src->seglen);
+    if(path == NULL)
+	*ok = 0;
+    return path;
+}
+
+static bsonenum clone_element(BSON *bson, bsonintern *in, const element_t *src, element_t *dst) {
+    int ok = 1;
+    *dst = *src;
+    dst->next = NULL;
+    dst->path = clone_path(in, src->path, &ok);
+    dst->leaf = bson_intern_str(in, src->leaf, strlen(src->leaf));
+    dst->data = clone_value(in, src);
+    if(!ok || dst->leaf == NULL || dst->data == NULL)
+	return BSON_MEMORY;
+    link_entry(bson, dst);
+    add_fingerprint(bson, dst->path, entry_fingerprint(dst));
+    return BSON_SUCCESS;
+}
+
+static void *clone_bytes(bsonarena *arena, const void *src, uint64_t size, uint64_t align) {
+    void *dst = bsonarena_alloc(arena, size, align);
+    if(dst != NULL)
+	memcpy(dst, src, size);
+    return dst;
+}
+
+/* Hottest first, ties in arena order */
+static int hotter(const void *a, const void *b) {
+    const element_t *x = *(const element_t **)(a), *y = *(const element_t **)(b);
+    if(x->reads != y->reads)
+	return x->reads > y->reads ? -1 : 1;
+    return x < y ? -1 : x > y;
+}
+
+static const element_t **sort_elements(const BSON *bson, bsonarena *a) {
+    const element_t **order = bsonarena_temp(a, (bson->count + 1) * sizeof(element_t *));
+    if(order == NULL)
 	return NULL;
+    uint64_t i, n = 0;
+    if(bson->frozen != NULL) {
+	for(i = 0; i < bson->count; i++)
+	    order[n++] = &bson->frozen[i];
     }
+    else {
+	for(i = 0; i < bson->elementsmax; i++) {
+	    const element_t *cur;
+	    for(cur = bson->elements[i]; cur != NULL; cur = cur->next)
+		order[n++] = cur;
+	}
+    }
+    qsort(order, n, sizeof(element_t *), hotter);
+    return order;
+}
 
-    if(*end == '.') {
-	intdbl.f = strtod(target, &end);
-	*type = BSON_DBL;
-	if(target == end) {
-	    bsonfree(target);
-	    *type = BSON_SYNTAX;
-	    return NULL;
+/* Entries are copied hottest first, each followed by its value, so the
+ * keys read most end up packed together at the front of the arena and of
+ * their buckets. Frozen slots are fixed by the hash, only their values
+ * move. */
+static bsonenum copy_elements(const BSON *src, BSON *dst, bsonintern *in, const element_t **order, element_t ***tails) {
+    bsonarena *a = &dst->arena;
+    uint64_t i;
+    if(src->frozen != NULL) {
+	for(i = 0; i < src->count; i++) {
+	    if(clone_element(dst, in, order[i], &dst->frozen[order[i] - src->frozen]) != BSON_SUCCESS)
+		return BSON_MEMORY;
 	}
+	return BSON_SUCCESS;
     }
-    bsonfree(target);
-    
-    void *data = bsonmalloc(sizeof(size_t) + sizeof(intdbl));
-    *((size_t *)(data)) = 1;
-    memcpy((size_t *)(data) + 1, &intdbl, sizeof(intdbl));
+    for(i = 0; i < src->elementsmax; i++)
+	tails[i] = &dst->elements[i];
+    for(i = 0; i < src->count; i++) {
+	element_t ***tail = &tails[order[i]->hash % src->elementsmax];
+	**tail = bsonarena_alloc(a, sizeof(element_t), sizeof(void *));
+	if(**tail == NULL || clone_element(dst, in, order[i], **tail) != BSON_SUCCESS)
+	    return BSON_MEMORY;
+	*tail = &(**tail)->next;
+    }
+    return BSON_SUCCESS;
+}
 
-    return data;
+static bsonenum clone_elements(const BSON *src, BSON *dst, bsonintern *in) {
+    bsonarena *a = &dst->arena;
+    if(src->frozen != NULL) {
+	dst->frozen = bsonarena_alloc(a, src->count * sizeof(element_t), sizeof(void *));
+	dst->mph.pilots = clone_bytes(a, src->mph.pilots, src->mph.buckets * sizeof(uint16_t), sizeof(uint16_t));
+	dst->mph.remap = clone_bytes(a, src->mph.remap, (src->mph.slots - src->mph.keys) * sizeof(uint32_t), sizeof(uint32_t));
+	if(dst->frozen == NULL || dst->mph.pilots == NULL || dst->mph.remap == NULL)
+	    return BSON_MEMORY;
+    }
+    else {
+	dst->elements = bsonarena_calloc(a, src->elementsmax * sizeof(element_t *), sizeof(element_t *));
+	if(dst->elements == NULL)
+	    return BSON_MEMORY;
+    }
+    const element_t **order = sort_elements(src, a);
+    if(order == NULL)
+	return BSON_MEMORY;
+    uint64_t tailsize = src->frozen != NULL ? 0 : src->elementsmax * sizeof(element_t **);
+    element_t ***tails = tailsize > 0 ? bsonarena_temp(a, tailsize) : NULL;
+    bsonenum ret = BSON_MEMORY;
+    if(tailsize == 0 || tails != NULL)
+	ret = copy_elements(src, dst, in, order, tails);
+    if(tails != NULL)
+	bsonarena_untemp(a, tails, tailsize);
+    bsonarena_untemp(a, order, (src->count + 1) * sizeof(element_t *));
+    return ret;
+}
+
+/* Deep copy of src into dst's arena. Counters and tracing stay behind. */
+static bsonenum clone_bson(const BSON *src, BSON *dst) {
+    bsonarena arena = dst->arena;
+    *dst = *src;
+    dst->arena = arena;
+    dst->hits = dst->misses = 0;
+    dst->bloomprobes = dst->bloomrejects = dst->bloomfalse = 0;
+    dst->trace = NULL;
+    dst->traceud = NULL;
+    dst->fingerprint = 0;
+    dst->topentries = NULL;
+    dst->retired = NULL;
+    dst->deadbytes = 0;
+    bsonarena *a = &dst->arena;
+
+    dst->filename = bsonarena_strdup(a, src->filename);
+    if(dst->filename == NULL)
+	return BSON_MEMORY;
+    bsonintern in;
+    if(!bson_intern_init(&in, a, src->count * 2))
+	return BSON_MEMORY;
+    bsonenum ret = clone_elements(src, dst, &in);
+    dst->paths    = in.all;
+    dst->toppaths = in.top;
+    bson_intern_release(&in);
+    if(ret != BSON_SUCCESS)
+	return ret;
+    if(src->bloom.bits != NULL) {
+	dst->bloom.bits = clone_bytes(a, src->bloom.bits, src->bloom.blocks * 64, 64);
+	if(dst->bloom.bits == NULL)
+	    return BSON_MEMORY;
+    }
+    return BSON_SUCCESS;
+}
+
+#define RELOCATE(ptr, delta) ((ptr) = (void *)((char *)(ptr) + (delta)))
+
+static void relocate_element(element_t *e, ptrdiff_t delta) {
+    RELOCATE(e->leaf, delta);
+    RELOCATE(e->data, delta);
+    if(e->path != NULL)
+	RELOCATE(e->path, delta);
+    if(e->next != NULL)
+	RELOCATE(e->next, delta);
+    if(e->sibling != NULL)
+	RELOCATE(e->sibling, delta);
+    if(e->type == BSON_STR) {
+	size_t len = *((size_t *)(e->data)), i;
+	char **strs = (char **)((size_t *)(e->data) + 1);
+	for(i = 0; i < len; i++)
+	    RELOCATE(strs[i], delta);
+    }
+}
+
+/* Paths are shared between elements, so they go through their own list */
+static void relocate_paths(BSON *bson, ptrdiff_t delta) {
+    bsonpath *p;
+    if(bson->paths != NULL)
+	RELOCATE(bson->paths, delta);
+    if(bson->toppaths != NULL)
+	RELOCATE(bson->toppaths, delta);
+    for(p = bson->paths; p != NULL; p = p->next) {
+	RELOCATE(p->segment, delta);
+	if(p->parent != NULL)
+	    RELOCATE(p->parent, delta);
+	if(p->next != NULL)
+	    RELOCATE(p->next, delta);
+	if(p->child != NULL)
+	    RELOCATE(p->child, delta);
+	if(p->sibling != NULL)
+	    RELOCATE(p->sibling, delta);
+	if(p->entries != NULL)
+	    RELOCATE(p->entries, delta);
+    }
+}
+
+static void relocate_bson(BSON *bson, ptrdiff_t delta) {
+    uint64_t i;
+    RELOCATE(bson->filename, delta);
+    if(bson->topentries != NULL)
+	RELOCATE(bson->topentries, delta);
+    relocate_paths(bson, delta);
+    if(bson->bloom.bits != NULL)
+	RELOCATE(bson->bloom.bits, delta);
+    if(bson->frozen != NULL) {
+	RELOCATE(bson->frozen, delta);
+	RELOCATE(bson->mph.pilots, delta);
+	RELOCATE(bson->mph.remap, delta);
+	for(i = 0; i < bson->count; i++)
+	    relocate_element(&bson->frozen[i], delta);
+	return;
+    }
+    RELOCATE(bson->elements, delta);
+    for(i = 0; i < bson->elementsmax; i++) {
+	element_t *cur;
+	if(bson->elements[i] != NULL)
+	    RELOCATE(bson->elements[i], delta);
+	for(cur = bson->elements[i]; cur != NULL; cur = cur->next)
+	    relocate_element(cur, delta);
+    }
+}
+
+/* Copies into a fresh mapping of fd, growing it until the copy fits */
+static bsonenum publish_into(const BSON *bson, int fd, uint64_t *size) {
+    for(;;) {
+	if(ftruncate(fd, *size) != 0)
+	    return BSON_MEMORY;
+	char *map = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(map == MAP_FAILED)
+	    return BSON_MEMORY;
+	shmheader *head = (shmheader *)(map);
+	uint64_t   skip = (sizeof(shmheader) + SHM_ALIGN - 1) & ~(uint64_t)(SHM_ALIGN - 1);
+	BSON      *dst  = (BSON *)(map + skip);
+	memset(dst, 0, sizeof(BSON));
+	bsonarena_fixed(&dst->arena, map + skip + sizeof(BSON), *size - skip - sizeof(BSON));
+	bsonenum ret = clone_bson(bson, dst);
+	if(ret == BSON_SUCCESS) {
+	    head->magic  = SHM_MAGIC;
+	    head->base   = (uintptr_t)(map);
+	    head->offset = skip;
+	    head->size   = skip + sizeof(BSON) + dst->arena.used;
+	    head->size   = (head->size + 4095) & ~(uint64_t)(4095);
+	    /* The arena is left pointing into the segment; attach drops it */
+	}
+	uint64_t used = ret == BSON_SUCCESS ? head->size : 0;
+	munmap(map, *size);
+	if(ret == BSON_SUCCESS) {
+	    *size = used;
+	    return ftruncate(fd, used) == 0 ? BSON_SUCCESS : BSON_MEMORY;
+	}
+	if(ret != BSON_MEMORY || *size > ((uint64_t)(1) << 40))
+	    return ret;
+	*size *= 2;
+    }
+}
+
+int bson_publish(const BSON *bson, const char *shmname, bsonenum *result) {
+    bsonenum ret = BSON_NULL_PTR;
+    int fd = -1;
+    if(bson == NULL)
+	goto fail;
+    ret = BSON_FILE_PATH;
+    /* A fresh object each time: whoever has the previous one mapped keeps it */
+    if(shmname != NULL) {
+	shm_unlink(shmname);
+	fd = shm_open(shmname, O_RDWR | O_CREAT | O_EXCL, 0644);
+    }
+    else
+	fd = memfd_create("bson", MFD_ALLOW_SEALING);
+    if(fd < 0)
+	goto fail;
+
+    /* Everything the source asked its arena for, plus worst case padding */
+    uint64_t size = sizeof(shmheader) + sizeof(BSON) + SHM_ALIGN * 2 +
+		    bson->arena.allocbytes + bson->arena.allocs * sizeof(void *);
+    ret = publish_into(bson, fd, &size);
+    if(ret != BSON_SUCCESS) {
+	if(shmname != NULL)
+	    shm_unlink(shmname);
+	goto fail;
+    }
+    /* Attachers trust a memfd to be immutable, so an unsealed one is no use */
+    if(shmname == NULL && fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0) {
+	ret = BSON_FILE_PATH;
+	goto fail;
+    }
+    if(result != NULL)
+	*result = BSON_SUCCESS;
+    return fd;
+
+fail:
+    if(fd >= 0)
+	close(fd);
+    if(result != NULL)
+	*result = ret;
+    return -1;
+}
+
+BSON *bson_attach(int fd, bsonenum *result) {
+    shmheader head;
+    struct stat st;
+    bsonenum ret = BSON_FILE_PATH;
+    if(fstat(fd, &st) != 0 || pread(fd, &head, sizeof(head), 0) != sizeof(head))
+	goto fail;
+    ret = BSON_INVALID_VALUE;
+    if(head.magic != SHM_MAGIC || head.size > (uint64_t)(st.st_size) || head.offset + sizeof(BSON) > head.size)
+	goto fail;
+
+    /* Same address as the publisher means nothing to fix up */
+    ret = BSON_MEMORY;
+    char *map = mmap((void *)(head.base), head.size, PROT_READ, MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+    if(map != MAP_FAILED && map != (char *)(head.base)) {
+	munmap(map, head.size);
+	map = MAP_FAILED;
+    }
+    if(map == MAP_FAILED) {
+	map = mmap(NULL, head.size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if(map == MAP_FAILED)
+	    goto fail;
+	relocate_bson((BSON *)(map + head.offset), map - (char *)(head.base));
+	mprotect(map, head.size, PROT_READ);
+    }
+    uint64_t copied = map == (char *)(head.base) ? 0 : head.size;
+
+    BSON *bson = bsoncalloc(1, sizeof(BSON));
+    if(bson == NULL) {
+	munmap(map, head.size);
+	goto fail;
+    }
+    memcpy(bson, map + head.offset, sizeof(BSON));
+    bsonarena_init(&bson->arena);
+    bson->flags  &= ~BSON_OPT_PROFILE; /* The entries are read-only */
+    bson->shm        = map;
+    bson->shmsize    = head.size;
+    bson->shmprivate = copied;
+    if(result != NULL)
+	*result = BSON_SUCCESS;
+    return bson;
+
+fail:
+    if(result != NULL)
+	*result = ret;
+    return NULL;
 }
 
 /*               */
@@ -782,13 +2350,19 @@ static void dpristr(char **data) {
     printf("]\n");
 }
 
-static void dpriint(long long *data) {
+static void dpriint(const element_t *e) {
     uint64_t i, len;
-    len = *((size_t *)(data));
-    long long *start = (long long *)((size_t *)(data) + 1);
-    printf("%lu int [ ", len);
+    len = *((size_t *)(e->data));
+    int width = e->narrow ? e->narrow : sizeof(long long);
+    const char *start = (const char *)((size_t *)(e->data) + 1);
+    if(e->narrow)
+	printf("%lu int%d [ ", len, width * 8);
+    else
+	printf("%lu int [ ", len);
     for(i = 0; i < len; i++) {
-	printf("%lld", start[i]);
+	long long v;
+	bson_widen_int(&v, start + i * width, width, 1);
+	printf("%lld", v);
 	if(i != len - 1)
 	    printf(", ");
 	else printf(" ");
@@ -796,13 +2370,19 @@ static void dpriint(long long *data) {
     printf("]\n");
 }
 
-static void dpridbl(double *data) {
+static void dpridbl(const element_t *e) {
     uint64_t i, len;
-    len = *((size_t *)(data));
-    double *start = (double *)((size_t *)(data) + 1);
-    printf("%lu dbl [ ", len);
+    len = *((size_t *)(e->data));
+    int width = e->narrow ? e->narrow : sizeof(double);
+    const char *start = (const char *)((size_t *)(e->data) + 1);
+    if(e->narrow)
+	printf("%lu dbl%d [ ", len, width * 8);
+    else
+	printf("%lu dbl [ ", len);
     for(i = 0; i < len; i++) {
-	printf("%lf", start[i]);
+	double v;
+	bson_widen_dbl(&v, start + i * width, width, 1);
+	printf("%lf", v);
 	if(i != len - 1)
 	    printf(", ");
 	else printf(" ");
@@ -810,8 +2390,42 @@ static void dpridbl(double *data) {
     printf("]\n");
 }
 
+static void dpripath(const bsonpath *p) {
+    if(p == NULL)
+	return;
+    dpripath(p->parent);
+    printf("%.*s.", (int)(p->seglen), p->segment);
+}
+
+static void dprielement(const element_t *e) {
+    printf("\t\"");
+    dpripath(e->path);
+    printf("%s\"\t\t\t= ", e->leaf);
+    switch(e->type) {
+	case BSON_STR:
+	    dpristr(e->data);
+	    break;
+	case BSON_INT:
+	    dpriint(e);
+	    break;
+	case BSON_DBL:
+	    dpridbl(e);
+	    break;
+	default:
+	    printf("\t<Invalid>\n");
+	    break;
+    }
+}
+
 void bson_debug_print(const BSON *bson) {
     uint64_t i;
+    if(bson->frozen != NULL) {
+	for(i = 0; i < bson->count; i++) {
+	    printf("%3lu:", i);
+	    dprielement(&bson->frozen[i]);
+	}
+	return;
+    }
     for(i = 0; i < bson->elementsmax; i++) {
 	printf("%3lu:", i);
 	element_t *e = bson->elements[i];
@@ -820,26 +2434,29 @@ void bson_debug_print(const BSON *bson) {
 	    continue;
 	}
 	do {
-	    printf("\t\"%s\"\t\t\t= ", e->name);
-	    switch(e->type) {
-		case BSON_STR:
-		    dpristr(e->data);
-		    break;
-		case BSON_INT:
-		    dpriint(e->data);
-		    break;
-		case BSON_DBL:
-		    dpridbl(e->data);
-		    break;
-		default:
-		    printf("\t<Invalid>\n");
-		    break;
-	    }
+	    dprielement(e);
 	    e = e->next;
 	} while(e != NULL);
     }
 }
 
+/* Sorting needs scratch space, which comes off the heap even for a
+ * document living in a caller's buffer. */
+void bson_profile_print(const BSON *bson, size_t top) {
+    bsonarena scratch;
+    bsonarena_init(&scratch);
+    const element_t **order = sort_elements(bson, &scratch);
+    if(order == NULL)
+	return;
+    size_t i;
+    for(i = 0; i < bson->count && (top == 0 || i < top); i++) {
+	printf("%12lu\t", (unsigned long)(order[i]->reads));
+	dpripath(order[i]->path);
+	printf("%s\n", order[i]->leaf);
+    }
+    bsonarena_untemp(&scratch, order, (bson->count + 1) * sizeof(element_t *));
+}
+
 /*               */
 
 
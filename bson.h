@@ -41,15 +41,223 @@ bsonenum bson_set_allocator(const bsonmem *a);
 
 typedef struct _s_BSON BSON;
 
+/* gzip and zlib files are inflated on a second thread while they parse;
+ * they fail with BSON_INVALID_VALUE in a buffer or when cut short. */
 BSON          *bson_open(const char *filepath, bsonenum *result);
+
+typedef enum {
+    BSON_TRACE_PHASE,   /* A load phase finished, see phase and nanos */
+    BSON_TRACE_ERROR,   /* Loading failed with result at line */
+    BSON_TRACE_LOOKUP   /* A key was looked up, hit says if it was there */
+} bsontracetype;
+
+typedef struct _s_bsontrace {
+    bsontracetype  type;
+    const char    *filename;
+    const char    *phase;
+    uint64_t       nanos;
+    bsonenum       result;
+    uint64_t       line;
+    const char    *key;
+    int            hit;
+} bsontrace;
+typedef void (*bson_pfn_trace)(const bsontrace *event, void *userdata);
+
+/* BSON_OPT_COMPACT stores each integer array as int8/16/32/64 and each
+ * decimal array as float when every item survives the trip. bson_int()
+ * and bson_dbl() return NULL for the narrowed ones; read them with
+ * bson_int_read() and bson_dbl_read() instead. */
+#define BSON_OPT_COMPACT 0x1 /* Store numbers in the narrowest lossless width */
+#define BSON_OPT_PROFILE 0x2 /* Count reads per key, see bson_relayout() */
+#define BSON_OPT_COUNT   0x4 /* Count hits, misses and Bloom filter outcomes, see bson_stats() */
+
+/* Called for every value as it is parsed, in file order. name only lives
+ * for the call, items for as long as the document (bson_len() works on
+ * them), and hash is bson_key_hash(name). A document opened with a visitor
+ * indexes nothing, it only owns the values. tools/bsongen builds on it. */
+typedef void (*bson_pfn_visit)(const char *name, uint64_t hash, bsonenum type, void *items, void *ud);
+
+/* With a buffer the whole document (index, names and values) is laid out
+ * inside it and the heap is never touched; opening fails with BSON_MEMORY
+ * if it does not fit. maxkeys sizes the table up front and, with a buffer,
+ * also caps the key count. Without it the table starts small and doubles
+ * as keys come, except in a buffer, where it stays small: set maxkeys for
+ * buffers that hold more than a few dozen keys. maxline bounds keys and
+ * lines in buffer mode. */
+typedef struct _s_bsonopts {
+    unsigned       flags;
+    void          *buffer;
+    size_t         buffersize;
+    size_t         maxkeys;
+    size_t         maxline;
+    bson_pfn_trace trace;
+    void          *traceud;
+    bson_pfn_visit visit;   /* Values go here instead of into the index */
+    void          *visitud;
+} bsonopts;
+BSON          *bson_open_opts(const char *filepath, const bsonopts *opts, bsonenum *result);
 void         bson_free(BSON **bson, bsonenum *result);
 
+/* Opens on a small pool of threads, started on first use, so many files
+ * load at once and alongside whatever else the caller does. opts is
+ * copied (a buffer in it has to stay around until the open finishes).
+ * Without done, bson_wait() blocks until the document is ready, hands it
+ * over and frees the ticket; it must be called exactly once. With done,
+ * the callback gets the document on a pool thread instead and NULL is
+ * returned. result tells whether the open was queued. */
+typedef struct _s_bsonticket bsonticket;
+typedef void (*bson_pfn_opened)(BSON *bson, bsonenum result, void *ud);
+bsonticket    *bson_open_async(const char *filepath, const bsonopts *opts, bson_pfn_opened done, void *ud, bsonenum *result);
+BSON          *bson_wait(bsonticket *ticket, bsonenum *result);
+
+/* include "path" on a line of its own puts the keys of another file under
+ * the enclosing object. Each fragment is parsed once per process and
+ * reused while its size and mtime stay the same; bson_include_flush()
+ * drops the cached ones (documents already loaded keep their copies).
+ * Since the cache lives on the heap, a document opened into a buffer
+ * fails on include with BSON_INVALID_VALUE. */
+void           bson_include_flush(void);
+
+/* Copies a loaded document into shared memory, a sealed memfd when shmname
+ * is NULL or a POSIX shm_open() object otherwise, and returns its fd. Any
+ * process holding that fd (inherited, passed over a socket or shm_open()ed
+ * read only) can bson_attach() it and use the normal accessors with no
+ * parse and no private copy, as long as the publisher's address range is
+ * free in the attaching process. When it is not, the mapping is made
+ * private and its pointers relocated, which writes to almost every page:
+ * that process pays for its own copy, reported as shmprivate by
+ * bson_stats(). A memfd that cannot be sealed is not handed out: the
+ * publish fails with BSON_FILE_PATH. Publishing under a name that exists
+ * replaces it, and processes attached to the old one keep it. */
+int          bson_publish(const BSON *bson, const char *shmname, bsonenum *result);
+BSON        *bson_attach(int fd, bsonenum *result);
+
+/* Equal strings anywhere in a document are stored once and shared, so the
+ * strings bson_str() hands out must not be written through: the change
+ * would show under every key holding that string. */
 long long   *bson_int(BSON *bson, const char *name);
 double      *bson_dbl(BSON *bson, const char *name);
 char       **bson_str(BSON *bson, const char *name);
 void        *bson_dat(BSON *bson, const char *name, bsonenum *result);
+
+/* Batched lookup. type is BSON_INT, BSON_DBL, BSON_STR or BSON_MAX for any;
+ * data gets what bson_int/bson_dbl/bson_str would return and result is
+ * BSON_SUCCESS, BSON_NOT_FOUND or BSON_INVALID_VALUE on a type mismatch.
+ * Returns how many were found. */
+typedef struct _s_bsonkey {
+    const char  *name;
+    bsonenum     type;
+    void        *data;
+    bsonenum     result;
+} bsonkey;
+size_t       bson_batch(BSON *bson, bsonkey *keys, size_t count);
 size_t       bson_len(void *ptr);
+
+/* Lookup with a hash computed ahead of time (bson.hpp does it at compile
+ * time). It has to be bson_key_hash() of the same name. type gets the
+ * value's type, BSON_NOT_FOUND, or BSON_INVALID_VALUE for narrowed values. */
+uint64_t     bson_key_hash(const char *name);
+void        *bson_find(BSON *bson, const char *name, uint64_t hash, bsonenum *type);
+
+/* Copies count items starting at first into dst, widening narrowed storage
+ * on the way, and returns how many were copied. With dst NULL it returns
+ * how many there are from first on. */
+size_t       bson_int_read(BSON *bson, const char *name, long long *dst, size_t first, size_t count);
+size_t       bson_dbl_read(BSON *bson, const char *name, double *dst, size_t first, size_t count);
+
+/* Target types for bson_copy() */
+typedef enum {
+    BSON_AS_INT8,
+    BSON_AS_INT16,
+    BSON_AS_INT32,
+    BSON_AS_INT64,
+    BSON_AS_FLOAT,
+    BSON_AS_DOUBLE
+} bsonas;
+
+#define BSON_COPY_SATURATE 0x1 /* Clamping to the target's range is fine */
+
+/* Copies count numbers starting at first into dst as type as, stride bytes
+ * apart (0 packs them), and returns how many were copied. Items outside
+ * the target's range (NaN included, for integers) are clamped; unless
+ * BSON_COPY_SATURATE is given that makes result BSON_INVALID_VALUE, as
+ * does an as that is not a bsonas. Arrays of four or more numbers start on a BSON_ALIGN boundary. */
+#define BSON_ALIGN 32
+size_t       bson_copy(BSON *bson, const char *name, bsonas as, void *dst, size_t stride, size_t first, size_t count, unsigned flags, bsonenum *result);
 void         bson_debug_print(const BSON *bson);
+/* Swaps the key table for a minimal perfect hash once loading is done.
+ * On the heap the document is then copied to a fresh arena without the
+ * old table, which is released: values and names looked up before the
+ * freeze are no longer valid. In a buffer nothing moves and the old
+ * table stays as dead bytes (deadbytes in bson_stats()), about one
+ * entry per key. Not while other threads look up. */
+bsonenum     bson_freeze(BSON *bson);
+
+/* With BSON_OPT_PROFILE every successful lookup bumps a per-key counter
+ * (a relaxed atomic add). bson_profile_print() lists the top keys by reads,
+ * all of them with top 0. bson_relayout() repacks entries and values
+ * hottest first and puts hot keys at the head of their buckets; frozen
+ * entries keep their slots and only their values move. Documents in a
+ * caller buffer or attached from shared memory cannot be relaid out.
+ * Values looked up before keep pointing at the old copy, which stays
+ * (counted in deadbytes) until bson_free(); look them up again to get
+ * the new layout. Not while other threads look up. */
+void         bson_profile_print(const BSON *bson, size_t top);
+bsonenum     bson_relayout(BSON *bson);
+
+/* Fingerprints are order independent hashes of every key and value in a
+ * document, or under a dotted prefix (0 when nothing is there), kept up
+ * as it loads: equal fingerprints mean equal contents, whatever the
+ * layout, and narrowed numbers count as what they hold. bson_diff() calls
+ * changed for each key only in from (removed), only in to (added) or in
+ * both with another value, skipping subtrees whose fingerprints agree,
+ * and returns how many it found. Only whole objects are skipped: within
+ * an object that differs every key is looked up on the other side, so a
+ * single change in a flat document costs a lookup per key. */
+typedef enum {
+    BSON_DIFF_ADDED,
+    BSON_DIFF_REMOVED,
+    BSON_DIFF_CHANGED
+} bsondiff;
+typedef void (*bson_pfn_diff)(const char *name, bsondiff what, void *ud);
+uint64_t     bson_fingerprint(const BSON *bson, const char *prefix);
+size_t       bson_diff(const BSON *from, const BSON *to, bson_pfn_diff changed, void *ud, bsonenum *result);
+
+#define BSON_CHAIN_BINS 8
+typedef struct _s_bsonstats {
+    uint64_t  keys;
+    int       frozen;
+    uint64_t  indexbytes;   /* Buckets plus chain links, or the perfect hash */
+    uint64_t  bloombits;    /* Size of the negative lookup filter */
+    uint64_t  bloomprobes;  /* Lookups that consulted the filter (BSON_OPT_COUNT) */
+    uint64_t  bloomrejects; /* Misses answered by the filter alone */
+    uint64_t  bloomfalse;   /* Filter passed, key was still absent */
+    double    bloomfpr;     /* Observed, bloomfalse / all misses */
+    double    bloomfprest;  /* Estimated from the filter's fill */
+    uint64_t  bytesread;
+    uint64_t  lines;
+    uint64_t  iotime;       /* Nanoseconds spent in read(2) */
+    uint64_t  parsetime;    /* Nanoseconds parsing, I/O excluded */
+    uint64_t  indextime;    /* Nanoseconds building the Bloom filter */
+    uint64_t  freezetime;   /* Nanoseconds spent in bson_freeze() */
+    uint64_t  allocs;       /* Arena allocations and the bytes they asked for */
+    uint64_t  allocbytes;
+    uint64_t  heapallocs;   /* Calls that made it to the bsonmem hooks */
+    uint64_t  heapbytes;
+    uint64_t  buckets;
+    double    loadfactor;
+    uint64_t  chains[BSON_CHAIN_BINS]; /* Buckets by chain length, the last bin takes the rest */
+    uint64_t  hits;         /* Lookups, with BSON_OPT_COUNT */
+    uint64_t  misses;
+    uint64_t  narrowsaved;  /* Bytes BSON_OPT_COMPACT saved */
+    uint64_t  internsaved;  /* Bytes interning kept out of the arena, net of paths and pointers */
+    uint64_t  includes;     /* include directives spliced in */
+    uint64_t  includehits;  /* Of those, fragments that were already parsed */
+    uint64_t  packedbytes;  /* Compressed bytes read; bytesread is after inflating */
+    uint64_t  deadbytes;    /* Left behind by bson_freeze() in a buffer and bson_relayout() */
+    uint64_t  shmprivate;   /* Bytes bson_attach() had to copy and relocate, 0 if shared */
+} bsonstats;
+bsonenum     bson_stats(const BSON *bson, bsonstats *stats);
 
 bsonenum       bson_res(const BSON *bson);
 const char  *bson_res_str(bsonenum res);
@@ -0,0 +1,165 @@
+#ifndef _BSON_HPP_
+#define _BSON_HPP_
+
+/* C++17 wrapper, header only. Literal keys wrapped in BSON_KEY() are
+ * hashed at compile time with the same MurmurHash64A as bson_hash(), so
+ * the lookup is the probe alone:
+ *
+ *     bson::document doc("texture.bson");
+ *     auto rows = doc.get<long long>(BSON_KEY("texture.grid.rows"));
+ *     if(rows)
+ *         draw(rows[0]);
+ *     for(const char *fruit : doc.get<char *>("shopping-list.fruits"))
+ *         puts(fruit);
+ *
+ * Plain strings work too and are hashed when called (the compiler may or
+ * may not fold a bare literal). */
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+#include "bson.h"
+
+namespace bson {
+
+/* Must stay identical to murmur64() in util.c */
+constexpr std::uint64_t murmur64_load(const char *p, std::size_t n) {
+    std::uint64_t k = 0;
+    while(n--)
+	k |= (std::uint64_t)((unsigned char)(p[n])) << (n * 8);
+    return k;
+}
+
+constexpr std::uint64_t hash(std::string_view key) {
+    const std::uint64_t m = 0xC6A4A7935BD1E995ULL;
+    std::uint64_t h = 199933 ^ (key.size() * m);
+    const char *p = key.data();
+    for(std::size_t i = key.size() >> 3; i; i--) {
+	std::uint64_t k = murmur64_load(p, 8);
+	p += 8;
+	k *= m;
+	k ^= k >> 47;
+	k *= m;
+	h ^= k;
+	h *= m;
+    }
+    if(key.size() & 7) {
+	h ^= murmur64_load(p, key.size() & 7);
+	h *= m;
+    }
+    h ^= h >> 47;
+    h *= m;
+    h ^= h >> 47;
+    return h;
+}
+
+/* A name and its hash. From a literal the constructor can be a constant
+ * expression; BSON_KEY() makes sure it is evaluated as one. Arrays are
+ * hashed up to their first NUL, so a name built into a char buffer at
+ * run time works too. */
+struct key {
+    const char    *name;
+    std::uint64_t  hash;
+
+    constexpr key(const char *name, std::uint64_t hash) : name(name), hash(hash) {}
+    template<std::size_t N>
+    constexpr key(const char (&name)[N]) : name(name), hash(bson::hash(std::string_view(name, std::char_traits<char>::length(name)))) {}
+    template<typename S, typename = std::enable_if_t<std::is_same_v<S, const char *> || std::is_same_v<S, char *>>>
+    key(S name) : name(name), hash(bson::hash(name)) {}
+};
+
+#define BSON_KEY(literal) \
+    (::bson::key((literal), std::integral_constant<std::uint64_t, ::bson::hash(literal)>::value))
+
+/* What a lookup gives back: the items and how many. Empty when the key
+ * is missing, has another type, or was narrowed (see BSON_OPT_COMPACT). */
+template<typename T>
+class array {
+public:
+    array() = default;
+    explicit array(T *items) : items(items), count(items ? bson_len(items) : 0) {}
+
+    T           *data()  const { return items; }
+    std::size_t  size()  const { return count; }
+    bool         empty() const { return count == 0; }
+    T           *begin() const { return items; }
+    T           *end()   const { return items + count; }
+    T           &operator[](std::size_t i) const { return items[i]; }
+    explicit     operator bool() const { return items != nullptr; }
+
+private:
+    T           *items = nullptr;
+    std::size_t  count = 0;
+};
+
+template<typename T> struct type_of;
+template<> struct type_of<long long>    { static constexpr bsonenum value = BSON_INT; };
+template<> struct type_of<double>       { static constexpr bsonenum value = BSON_DBL; };
+template<> struct type_of<char *>       { static constexpr bsonenum value = BSON_STR; };
+template<> struct type_of<const char *> { static constexpr bsonenum value = BSON_STR; };
+
+/* Owns a BSON for as long as it lives. Failure to open leaves it empty,
+ * with the reason in result(). */
+class document {
+public:
+    document() = default;
+    explicit document(const char *path, const bsonopts *opts = nullptr) {
+	doc = bson_open_opts(path, opts, &res);
+    }
+    ~document() { close(); }
+
+    document(const document &) = delete;
+    document &operator=(const document &) = delete;
+    document(document &&other) noexcept : doc(std::exchange(other.doc, nullptr)), res(other.res) {}
+    document &operator=(document &&other) noexcept {
+	if(this != &other) {
+	    close();
+	    doc = std::exchange(other.doc, nullptr);
+	    res = other.res;
+	}
+	return *this;
+    }
+
+    explicit operator bool() const { return doc != nullptr; }
+    bsonenum result() const { return res; }
+    BSON *handle() const { return doc; }
+    BSON *release() { return std::exchange(doc, nullptr); }
+
+    template<typename T>
+    array<T> get(key k) const {
+	bsonenum type;
+	void *items = doc ? bson_find(doc, k.name, k.hash, &type) : nullptr;
+	if(items == nullptr || type != type_of<T>::value)
+	    return array<T>();
+	return array<T>(static_cast<T *>(items));
+    }
+
+    /* First item, or fallback */
+    template<typename T>
+    T value(key k, T fallback = T()) const {
+	array<T> a = get<T>(k);
+	return a.empty() ? fallback : a[0];
+    }
+
+    /* Arrays taken before no longer point at the document, see bson_freeze() */
+    bsonenum freeze() { return doc ? bson_freeze(doc) : BSON_NULL_PTR; }
+
+    bsonenum stats(bsonstats *stats) const { return bson_stats(doc, stats); }
+
+    void close() {
+	if(doc != nullptr)
+	    bson_free(&doc, &res);
+    }
+
+private:
+    BSON     *doc = nullptr;
+    bsonenum  res = BSON_NULL_PTR;
+};
+
+}
+
+#endif
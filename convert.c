@@ -0,0 +1,352 @@
+#include "convert.h"
+
+#include <string.h>
+#include <float.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
+/* NARROWING */
+
+int bson_narrow_width_int(const long long *src, size_t n) {
+    long long lo = 0, hi = 0;
+    size_t i;
+    for(i = 0; i < n; i++) {
+	lo = src[i] < lo ? src[i] : lo;
+	hi = src[i] > hi ? src[i] : hi;
+    }
+    if(lo >= INT8_MIN  && hi <= INT8_MAX)  return 1;
+    if(lo >= INT16_MIN && hi <= INT16_MAX) return 2;
+    if(lo >= INT32_MIN && hi <= INT32_MAX) return 4;
+    return 8;
+}
+
+int bson_narrow_width_dbl(const double *src, size_t n) {
+    size_t i;
+    for(i = 0; i < n; i++) {
+	if((double)((float)(src[i])) != src[i])
+	    return 8;
+    }
+    return 4;
+}
+
+/* Going front to back is safe in place, item i never lands past where it
+ * was read from. */
+void bson_narrow_int(void *dst, const long long *src, int width, size_t n) {
+    size_t i;
+    switch(width) {
+	case 1: for(i = 0; i < n; i++) ((int8_t  *)(dst))[i] = (int8_t)(src[i]);  break;
+	case 2: for(i = 0; i < n; i++) ((int16_t *)(dst))[i] = (int16_t)(src[i]); break;
+	case 4: for(i = 0; i < n; i++) ((int32_t *)(dst))[i] = (int32_t)(src[i]); break;
+	default: memmove(dst, src, n * sizeof(long long)); break;
+    }
+}
+
+void bson_narrow_dbl(void *dst, const double *src, int width, size_t n) {
+    size_t i;
+    if(width == 4) {
+	for(i = 0; i < n; i++)
+	    ((float *)(dst))[i] = (float)(src[i]);
+    }
+    else
+	memmove(dst, src, n * sizeof(double));
+}
+
+/*               */
+
+
+/*   WIDENING    */
+
+static void widen_i8(long long *dst, const int8_t *src, size_t n)   { size_t i; for(i = 0; i < n; i++) dst[i] = src[i]; }
+static void widen_i16(long long *dst, const int16_t *src, size_t n) { size_t i; for(i = 0; i < n; i++) dst[i] = src[i]; }
+static void widen_i32(long long *dst, const int32_t *src, size_t n) { size_t i; for(i = 0; i < n; i++) dst[i] = src[i]; }
+static void widen_f32(double *dst, const float *src, size_t n)      { size_t i; for(i = 0; i < n; i++) dst[i] = src[i]; }
+
+#ifdef HAVE_X86
+__attribute__((target("avx2")))
+static void widen_i8_avx2(long long *dst, const int8_t *src, size_t n) {
+    size_t i = 0;
+    for(; i + 16 <= n; i += 16) {
+	__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+	_mm256_storeu_si256((__m256i *)(dst + i),      _mm256_cvtepi8_epi64(v));
+	_mm256_storeu_si256((__m256i *)(dst + i + 4),  _mm256_cvtepi8_epi64(_mm_srli_si128(v, 4)));
+	_mm256_storeu_si256((__m256i *)(dst + i + 8),  _mm256_cvtepi8_epi64(_mm_srli_si128(v, 8)));
+	_mm256_storeu_si256((__m256i *)(dst + i + 12), _mm256_cvtepi8_epi64(_mm_srli_si128(v, 12)));
+    }
+    widen_i8(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void widen_i16_avx2(long long *dst, const int16_t *src, size_t n) {
+    size_t i = 0;
+    for(; i + 8 <= n; i += 8) {
+	__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+	_mm256_storeu_si256((__m256i *)(dst + i),     _mm256_cvtepi16_epi64(v));
+	_mm256_storeu_si256((__m256i *)(dst + i + 4), _mm256_cvtepi16_epi64(_mm_srli_si128(v, 8)));
+    }
+    widen_i16(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void widen_i32_avx2(long long *dst, const int32_t *src, size_t n) {
+    size_t i = 0;
+    for(; i + 4 <= n; i += 4)
+	_mm256_storeu_si256((__m256i *)(dst + i), _mm256_cvtepi32_epi64(_mm_loadu_si128((const __m128i *)(src + i))));
+    widen_i32(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void widen_f32_avx2(double *dst, const float *src, size_t n) {
+    size_t i = 0;
+    for(; i + 4 <= n; i += 4)
+	_mm256_storeu_pd(dst + i, _mm256_cvtps_pd(_mm_loadu_ps(src + i)));
+    widen_f32(dst + i, src + i, n - i);
+}
+#endif
+
+/*  CONVERSION   */
+
+/* Integer targets clamp at the first value truncation cannot bring back
+ * in range, NaN becomes 0. Both count as clamped. */
+#define CLAMP_INT(T, LO, HI)						\
+static size_t int_to_##T(T##_t *dst, const long long *src, size_t n) {	\
+    size_t i, clamped = 0;						\
+    for(i = 0; i < n; i++) {						\
+	long long v = src[i];						\
+	clamped += v < LO || v > HI;					\
+	dst[i] = v < LO ? LO : v > HI ? HI : (T##_t)(v);		\
+    }									\
+    return clamped;							\
+}									\
+static size_t dbl_to_##T(T##_t *dst, const double *src, size_t n) {	\
+    size_t i, clamped = 0;						\
+    for(i = 0; i < n; i++) {						\
+	double v = src[i];						\
+	if(v != v)			{ dst[i] = 0;  clamped++; }	\
+	else if(v <= (double)(LO) - 1.0) { dst[i] = LO; clamped++; }	\
+	else if(v >= (double)(HI) + 1.0) { dst[i] = HI; clamped++; }	\
+	else				dst[i] = (T##_t)(v);		\
+    }									\
+    return clamped;							\
+}
+CLAMP_INT(int8,  INT8_MIN,  INT8_MAX)
+CLAMP_INT(int16, INT16_MIN, INT16_MAX)
+CLAMP_INT(int32, INT32_MIN, INT32_MAX)
+
+/* -2^63 - 1 and 2^63 - 1 are not doubles, so the bounds are spelled out */
+static size_t dbl_to_int64(int64_t *dst, const double *src, size_t n) {
+    size_t i, clamped = 0;
+    for(i = 0; i < n; i++) {
+	double v = src[i];
+	if(v != v)				    { dst[i] = 0;	  clamped++; }
+	else if(v < -9223372036854775808.0)  { dst[i] = INT64_MIN; clamped++; }
+	else if(v >= 9223372036854775808.0)  { dst[i] = INT64_MAX; clamped++; }
+	else					    dst[i] = (int64_t)(v);
+    }
+    return clamped;
+}
+
+static size_t int_to_float(float *dst, const long long *src, size_t n) {
+    size_t i;
+    for(i = 0; i < n; i++)
+	dst[i] = (float)(src[i]);
+    return 0;
+}
+
+static size_t int_to_double(double *dst, const long long *src, size_t n) {
+    size_t i;
+    for(i = 0; i < n; i++)
+	dst[i] = (double)(src[i]);
+    return 0;
+}
+
+/* Finite doubles past FLT_MAX clamp to it; infinities and NaN go through */
+static size_t dbl_to_float(float *dst, const double *src, size_t n) {
+    size_t i, clamped = 0;
+    for(i = 0; i < n; i++) {
+	double v = src[i];
+	if(v > FLT_MAX && v != INFINITY)	    { dst[i] = FLT_MAX;  clamped++; }
+	else if(v < -FLT_MAX && v != -INFINITY) { dst[i] = -FLT_MAX; clamped++; }
+	else					    dst[i] = (float)(v);
+    }
+    return clamped;
+}
+
+#ifdef HAVE_X86
+__attribute__((target("avx2")))
+static size_t int_to_int32_avx2(int32_t *dst, const long long *src, size_t n) {
+    const __m256i lo   = _mm256_set1_epi64x(INT32_MIN);
+    const __m256i hi   = _mm256_set1_epi64x(INT32_MAX);
+    const __m256i pack = _mm256_setr_epi32(0, 2, 4, 6, 0, 0, 0, 0);
+    size_t i = 0, clamped = 0;
+    for(; i + 4 <= n; i += 4) {
+	__m256i v     = _mm256_loadu_si256((const __m256i *)(src + i));
+	__m256i under = _mm256_cmpgt_epi64(lo, v);
+	__m256i over  = _mm256_cmpgt_epi64(v, hi);
+	v = _mm256_blendv_epi8(v, lo, under);
+	v = _mm256_blendv_epi8(v, hi, over);
+	clamped += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_or_si256(under, over))));
+	_mm_storeu_si128((__m128i *)(dst + i), _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(v, pack)));
+    }
+    return clamped + int_to_int32(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static size_t dbl_to_int32_avx2(int32_t *dst, const double *src, size_t n) {
+    const __m256d lo    = _mm256_set1_pd((double)(INT32_MIN));
+    const __m256d hi    = _mm256_set1_pd((double)(INT32_MAX));
+    const __m256d below = _mm256_set1_pd((double)(INT32_MIN) - 1.0);
+    const __m256d above = _mm256_set1_pd((double)(INT32_MAX) + 1.0);
+    size_t i = 0, clamped = 0;
+    for(; i + 4 <= n; i += 4) {
+	__m256d v     = _mm256_loadu_pd(src + i);
+	__m256d nan   = _mm256_cmp_pd(v, v, _CMP_UNORD_Q);
+	__m256d under = _mm256_cmp_pd(v, below, _CMP_LE_OQ);
+	__m256d over  = _mm256_cmp_pd(v, above, _CMP_GE_OQ);
+	v = _mm256_blendv_pd(v, lo, under);
+	v = _mm256_blendv_pd(v, hi, over);
+	v = _mm256_andnot_pd(nan, v);
+	clamped += __builtin_popcount(_mm256_movemask_pd(_mm256_or_pd(nan, _mm256_or_pd(under, over))));
+	_mm_storeu_si128((__m128i *)(dst + i), _mm256_cvttpd_epi32(v));
+    }
+    return clamped + dbl_to_int32(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static size_t dbl_to_float_avx2(float *dst, const double *src, size_t n) {
+    const __m256d max  = _mm256_set1_pd(FLT_MAX);
+    const __m256d inf  = _mm256_set1_pd(INFINITY);
+    const __m256d sign = _mm256_set1_pd(-0.0);
+    size_t i = 0, clamped = 0;
+    for(; i + 4 <= n; i += 4) {
+	__m256d v    = _mm256_loadu_pd(src + i);
+	__m256d mag  = _mm256_andnot_pd(sign, v);
+	__m256d over = _mm256_and_pd(_mm256_cmp_pd(mag, max, _CMP_GT_OQ), _mm256_cmp_pd(mag, inf, _CMP_LT_OQ));
+	v = _mm256_blendv_pd(v, _mm256_or_pd(max, _mm256_and_pd(sign, v)), over);
+	clamped += __builtin_popcount(_mm256_movemask_pd(over));
+	_mm_storeu_ps(dst + i, _mm256_cvtpd_ps(v));
+    }
+    return clamped + dbl_to_float(dst + i, src + i, n - i);
+}
+#endif
+
+/* Picked once, the first time anything gets widened */
+static struct {
+    int    ready;
+    void (*i8)(long long *, const int8_t *, size_t);
+    void (*i16)(long long *, const int16_t *, size_t);
+    void (*i32)(long long *, const int32_t *, size_t);
+    void (*f32)(double *, const float *, size_t);
+    size_t (*int_to_int32)(int32_t *, const long long *, size_t);
+    size_t (*dbl_to_int32)(int32_t *, const double *, size_t);
+    size_t (*dbl_to_float)(float *, const double *, size_t);
+} kernels;
+
+static void pick_kernels(void) {
+    kernels.i8  = widen_i8;
+    kernels.i16 = widen_i16;
+    kernels.i32 = widen_i32;
+    kernels.f32 = widen_f32;
+    kernels.int_to_int32 = int_to_int32;
+    kernels.dbl_to_int32 = dbl_to_int32;
+    kernels.dbl_to_float = dbl_to_float;
+#ifdef HAVE_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+	kernels.i8  = widen_i8_avx2;
+	kernels.i16 = widen_i16_avx2;
+	kernels.i32 = widen_i32_avx2;
+	kernels.f32 = widen_f32_avx2;
+	kernels.int_to_int32 = int_to_int32_avx2;
+	kernels.dbl_to_int32 = dbl_to_int32_avx2;
+	kernels.dbl_to_float = dbl_to_float_avx2;
+    }
+#endif
+    __atomic_store_n(&kernels.ready, 1, __ATOMIC_RELEASE);
+}
+
+void bson_widen_int(long long *dst, const void *src, int width, size_t n) {
+    if(!__atomic_load_n(&kernels.ready, __ATOMIC_ACQUIRE))
+	pick_kernels();
+    switch(width) {
+	case 1:  kernels.i8(dst, src, n);  break;
+	case 2:  kernels.i16(dst, src, n); break;
+	case 4:  kernels.i32(dst, src, n); break;
+	default: memcpy(dst, src, n * sizeof(long long)); break;
+    }
+}
+
+void bson_widen_dbl(double *dst, const void *src, int width, size_t n) {
+    if(!__atomic_load_n(&kernels.ready, __ATOMIC_ACQUIRE))
+	pick_kernels();
+    if(width == 4)
+	kernels.f32(dst, src, n);
+    else
+	memcpy(dst, src, n * sizeof(double));
+}
+
+size_t bson_as_size(bsonas as) {
+    static const size_t sizes[] = { 1, 2, 4, 8, 4, 8 };
+    return sizes[as];
+}
+
+static size_t convert_int(void *dst, bsonas as, const long long *src, size_t n) {
+    switch(as) {
+	case BSON_AS_INT8:   return int_to_int8(dst, src, n);
+	case BSON_AS_INT16:  return int_to_int16(dst, src, n);
+	case BSON_AS_INT32:  return kernels.int_to_int32(dst, src, n);
+	case BSON_AS_FLOAT:  return int_to_float(dst, src, n);
+	case BSON_AS_DOUBLE: return int_to_double(dst, src, n);
+	default: memcpy(dst, src, n * sizeof(long long)); return 0;
+    }
+}
+
+static size_t convert_dbl(void *dst, bsonas as, const double *src, size_t n) {
+    switch(as) {
+	case BSON_AS_INT8:   return dbl_to_int8(dst, src, n);
+	case BSON_AS_INT16:  return dbl_to_int16(dst, src, n);
+	case BSON_AS_INT32:  return kernels.dbl_to_int32(dst, src, n);
+	case BSON_AS_INT64:  return dbl_to_int64(dst, src, n);
+	case BSON_AS_FLOAT:  return kernels.dbl_to_float(dst, src, n);
+	default: memcpy(dst, src, n * sizeof(double)); return 0;
+    }
+}
+
+/* Narrowed sources are widened a chunk at a time into the stack and
+ * strided targets converted into the stack then scattered, so every pair
+ * goes through one of the kernels above. */
+#define CHUNK 256
+
+size_t bson_convert(void *dst, size_t stride, bsonas as, const void *src, bsonenum type, int width, size_t n) {
+    long long wide[CHUNK], packed[CHUNK];
+    size_t size = bson_as_size(as), clamped = 0, i, j;
+    if(stride == 0)
+	stride = size;
+    if(!__atomic_load_n(&kernels.ready, __ATOMIC_ACQUIRE))
+	pick_kernels();
+    for(i = 0; i < n; i += CHUNK) {
+	size_t len = n - i < CHUNK ? n - i : CHUNK;
+	const void *from = (const char *)(src) + i * width;
+	if(width != 8) {
+	    if(type == BSON_INT)
+		bson_widen_int(wide, from, width, len);
+	    else
+		bson_widen_dbl((double *)(wide), from, width, len);
+	    from = wide;
+	}
+	char *to = (char *)(dst) + i * stride;
+	void *out = stride == size ? (void *)(to) : (void *)(packed);
+	if(type == BSON_INT)
+	    clamped += convert_int(out, as, from, len);
+	else
+	    clamped += convert_dbl(out, as, from, len);
+	if(out == packed) {
+	    for(j = 0; j < len; j++)
+		memcpy(to + j * stride, (char *)(packed) + j * size, size);
+	}
+    }
+    return clamped;
+}
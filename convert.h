@@ -0,0 +1,25 @@
+#ifndef _BSON_CONVERT_H_
+#define _BSON_CONVERT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bson.h"
+
+/* Narrowest lossless width of an array, in bytes per item: 1, 2, 4 or 8
+ * for integers, 4 (float) or 8 for decimals. */
+int   bson_narrow_width_int(const long long *src, size_t n);
+int   bson_narrow_width_dbl(const double *src, size_t n);
+void  bson_narrow_int(void *dst, const long long *src, int width, size_t n);
+void  bson_narrow_dbl(void *dst, const double *src, int width, size_t n);
+
+/* And back, vectorized when the CPU has AVX2 */
+void  bson_widen_int(long long *dst, const void *src, int width, size_t n);
+void  bson_widen_dbl(double *dst, const void *src, int width, size_t n);
+
+/* Converts n items of src (integers or decimals, width bytes each) into
+ * dst as type as, stride bytes apart. Returns how many had to be clamped. */
+size_t bson_convert(void *dst, size_t stride, bsonas as, const void *src, bsonenum type, int width, size_t n);
+size_t bson_as_size(bsonas as);
+
+#endif
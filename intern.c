@@ -0,0 +1,137 @@
+#include <string.h>
+
+#include "intern.h"
+#include "util.h"
+
+#define INTERN_MIN 256
+
+static int table_init(bsoninterntable *t, bsonarena *arena, uint64_t slots) {
+    uint64_t max = INTERN_MIN;
+    while(max < slots)
+	max *= 2;
+    t->slots = bsonarena_temp(arena, max * sizeof(bsoninternslot));
+    if(t->slots == NULL)
+	return 0;
+    memset(t->slots, 0, max * sizeof(bsoninternslot));
+    t->max   = max;
+    t->count = 0;
+    return 1;
+}
+
+/* Doubles on the heap. A fixed buffer cannot give temporaries back out of
+ * order, so there the table just stops taking new items. */
+static int table_room(bsoninterntable *t, bsonarena *arena) {
+    if((t->count + 1) * 8 <= t->max * 7)
+	return 1;
+    if(arena->fixed)
+	return 0;
+    bsoninterntable bigger;
+    if(!table_init(&bigger, arena, t->max * 2))
+	return 0;
+    uint64_t i, at;
+    for(i = 0; i < t->max; i++) {
+	if(t->slots[i].item == NULL)
+	    continue;
+	for(at = t->slots[i].hash & (bigger.max - 1); bigger.slots[at].item != NULL; at = (at + 1) & (bigger.max - 1));
+	bigger.slots[at] = t->slots[i];
+    }
+    bigger.count = t->count;
+    bsonarena_untemp(arena, t->slots, t->max * sizeof(bsoninternslot));
+    *t = bigger;
+    return 1;
+}
+
+static void table_put(bsoninterntable *t, uint64_t at, uint64_t hash, const void *item) {
+    t->slots[at].hash = hash;
+    t->slots[at].item = item;
+    t->count++;
+}
+
+int bson_intern_init(bsonintern *in, bsonarena *arena, uint64_t slots) {
+    memset(in, 0, sizeof(bsonintern));
+    in->arena = arena;
+    if(!table_init(&in->strs, arena, slots))
+	return 0;
+    if(!table_init(&in->paths, arena, slots / 4)) {
+	bsonarena_untemp(arena, in->strs.slots, in->strs.max * sizeof(bsoninternslot));
+	return 0;
+    }
+    return 1;
+}
+
+const char *bson_intern_str(bsonintern *in, const char *str, uint64_t len) {
+    bsoninterntable *t = &in->strs;
+    uint64_t hash = bson_hash_len(str, len), at;
+    for(at = hash & (t->max - 1); t->slots[at].item != NULL; at = (at + 1) & (t->max - 1)) {
+	const char *cur = t->slots[at].item;
+	if(t->slots[at].hash == hash && memcmp(cur, str, len) == 0 && cur[len] == '\0')
+	    return cur;
+    }
+    char *copy = bsonarena_alloc(in->arena, len + 1, 1);
+    if(copy == NULL)
+	return NULL;
+    in->copied += len + 1;
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    if(table_room(t, in->arena)) {
+	for(at = hash & (t->max - 1); t->slots[at].item != NULL; at = (at + 1) & (t->max - 1));
+	table_put(t, at, hash, copy);
+    }
+    return copy;
+}
+
+/* The segment is interned first, so a path is known by its parent and
+ * segment pointers alone. */
+const bsonpath *bson_intern_path(bsonintern *in, const bsonpath *parent, const char *segment, uint64_t seglen) {
+    const char *seg = bson_intern_str(in, segment, seglen);
+    if(seg == NULL)
+	return NULL;
+    bsoninterntable *t = &in->paths;
+    const void *key[2] = { parent, seg };
+    uint64_t hash = bson_hash_len((const char *)(key), sizeof(key)), at;
+    for(at = hash & (t->max - 1); t->slots[at].item != NULL; at = (at + 1) & (t->max - 1)) {
+	const bsonpath *cur = t->slots[at].item;
+	if(cur->parent == parent && cur->segment == seg)
+	    return cur;
+    }
+    bsonpath *path = bsonarena_calloc(in->arena, sizeof(bsonpath), sizeof(void *));
+    if(path == NULL)
+	return NULL;
+    in->copied += sizeof(bsonpath);
+    path->parent  = parent;
+    path->segment = seg;
+    path->seglen  = seglen;
+    path->len     = parent == NULL ? seglen : parent->len + 1 + seglen;
+    path->next    = in->all;
+    in->all = path;
+    /* The parent is ours to link into, it came out of this arena too */
+    bsonpath **first = parent == NULL ? &in->top : &((bsonpath *)(parent))->child;
+    path->sibling = *first;
+    *first = path;
+    if(table_room(t, in->arena)) {
+	for(at = hash & (t->max - 1); t->slots[at].item != NULL; at = (at + 1) & (t->max - 1));
+	table_put(t, at, hash, path);
+    }
+    return path;
+}
+
+const bsonpath *bson_intern_dotted(bsonintern *in, const bsonpath *parent, const char *name, uint64_t len) {
+    const char *dot;
+    while((dot = memchr(name, '.', len)) != NULL) {
+	if((parent = bson_intern_path(in, parent, name, dot - name)) == NULL)
+	    return NULL;
+	len  -= dot - name + 1;
+	name  = dot + 1;
+    }
+    return bson_intern_path(in, parent, name, len);
+}
+
+/* Taken in that order, so given back in the reverse */
+void bson_intern_release(bsonintern *in) {
+    if(in->paths.slots != NULL)
+	bsonarena_untemp(in->arena, in->paths.slots, in->paths.max * sizeof(bsoninternslot));
+    if(in->strs.slots != NULL)
+	bsonarena_untemp(in->arena, in->strs.slots, in->strs.max * sizeof(bsoninternslot));
+    in->paths.slots = NULL;
+    in->strs.slots  = NULL;
+}
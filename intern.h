@@ -0,0 +1,55 @@
+#ifndef _BSON_INTERN_H_
+#define _BSON_INTERN_H_
+
+#include <stdint.h>
+
+#include "allocator.h"
+
+/* One object scope of a dotted name. Paths share their parents, so a
+ * prefix is stored once however many keys live under it. Segments hold
+ * no dots: a.b = 1 and a { b = 1 } end up in the same tree. */
+typedef struct _s_bsonpath {
+    const struct _s_bsonpath *parent;
+    const char               *segment;
+    uint64_t                  seglen;
+    uint64_t                  len;     /* Of the whole dotted path */
+    struct _s_bsonpath       *next;    /* Every path of the document */
+    struct _s_bsonpath       *child;   /* First path directly inside */
+    struct _s_bsonpath       *sibling;
+    void                     *entries; /* First key directly inside, see bson.c */
+    uint64_t                  fingerprint; /* Of every key inside, see bson.c */
+} bsonpath;
+
+typedef struct {
+    uint64_t    hash;
+    const void *item;
+} bsoninternslot;
+
+typedef struct {
+    bsoninternslot *slots;
+    uint64_t        max;
+    uint64_t        count;
+} bsoninterntable;
+
+/* Parse time only. The tables are arena temporaries: on the heap they
+ * grow, in a fixed buffer they stay at the size they started with and
+ * anything that no longer fits is simply copied. What they hand out lives
+ * in the arena for as long as the document does. */
+typedef struct {
+    bsonarena       *arena;
+    bsoninterntable  strs;
+    bsoninterntable  paths;
+    bsonpath        *all;
+    bsonpath        *top;   /* Paths with no parent */
+    uint64_t         wanted; /* Bytes plain copies would have taken, kept by the caller */
+    uint64_t         copied; /* Bytes of strings and paths actually stored */
+} bsonintern;
+
+int             bson_intern_init(bsonintern *in, bsonarena *arena, uint64_t slots);
+const char     *bson_intern_str(bsonintern *in, const char *str, uint64_t len);
+const bsonpath *bson_intern_path(bsonintern *in, const bsonpath *parent, const char *segment, uint64_t seglen);
+/* One path per dot separated segment of name, the last one returned */
+const bsonpath *bson_intern_dotted(bsonintern *in, const bsonpath *parent, const char *name, uint64_t len);
+void            bson_intern_release(bsonintern *in);
+
+#endif
@@ -0,0 +1,163 @@
+#include "mph.h"
+#include "allocator.h"
+
+#include <string.h>
+
+#define MPH_BUCKET_SIZE    5
+#define MPH_LOAD         0.98
+#define MPH_PILOTS     65536
+#define MPH_ATTEMPTS       8
+
+typedef struct {
+    bsonarena *arena;
+    void      *ptr[5];
+    uint64_t   size[5];
+    int        count;
+} mphtemp;
+
+static void *mph_temp(mphtemp *t, uint64_t size) {
+    void *ptr = bsonarena_temp(t->arena, size);
+    if(ptr != NULL) {
+	t->ptr[t->count]    = ptr;
+	t->size[t->count++] = size;
+    }
+    return ptr;
+}
+
+static void mph_untemp(mphtemp *t) {
+    while(t->count > 0) {
+	t->count--;
+	bsonarena_untemp(t->arena, t->ptr[t->count], t->size[t->count]);
+    }
+}
+
+/* One attempt with mph->seed. Returns BSON_CONTINUE when some bucket ran out
+ * of pilots, so the caller can reseed and go again. */
+static bsonenum mph_search(bsonmph *mph, bsonarena *arena, const uint64_t *hashes) {
+    mphtemp   temp   = { .arena = arena };
+    uint64_t  n = mph->keys, i, j, k;
+    uint64_t *mixed  = mph_temp(&temp, n * sizeof(uint64_t));
+    uint64_t *start  = mph_temp(&temp, (mph->buckets + 1) * sizeof(uint64_t));
+    uint64_t *order  = mph_temp(&temp, n * sizeof(uint64_t));
+    uint8_t  *taken  = mph_temp(&temp, mph->slots);
+    if(mixed == NULL || start == NULL || order == NULL || taken == NULL) {
+	mph_untemp(&temp);
+	return BSON_MEMORY;
+    }
+    memset(start, 0, (mph->buckets + 1) * sizeof(uint64_t));
+    memset(taken, 0, mph->slots);
+
+    /* Counting sort of the keys by bucket */
+    for(i = 0; i < n; i++) {
+	mixed[i] = bson_mph_mix(hashes[i] ^ mph->seed);
+	start[bson_mph_bucket(mph, mixed[i]) + 1]++;
+    }
+    uint64_t largest = 0;
+    for(i = 0; i < mph->buckets; i++) {
+	if(start[i + 1] > largest)
+	    largest = start[i + 1];
+	start[i + 1] += start[i];
+    }
+    uint64_t *fill = mph_temp(&temp, (mph->buckets + largest + 1) * sizeof(uint64_t));
+    if(fill == NULL) {
+	mph_untemp(&temp);
+	return BSON_MEMORY;
+    }
+    memcpy(fill, start, mph->buckets * sizeof(uint64_t));
+    for(i = 0; i < n; i++)
+	order[fill[bson_mph_bucket(mph, mixed[i])]++] = mixed[i];
+
+    /* Then the buckets by size, biggest first, while the table is emptiest.
+     * fill is reused: the first (largest + 1) words count, the rest index. */
+    uint64_t *bysize = fill + largest + 1;
+    uint64_t *sizeat = fill;
+    memset(sizeat, 0, (largest + 1) * sizeof(uint64_t));
+    for(i = 0; i < mph->buckets; i++)
+	sizeat[largest - (start[i + 1] - start[i])]++;
+    for(i = 0, k = 0; i <= largest; i++) {
+	uint64_t c = sizeat[i];
+	sizeat[i] = k;
+	k += c;
+    }
+    for(i = 0; i < mph->buckets; i++)
+	bysize[sizeat[largest - (start[i + 1] - start[i])]++] = i;
+
+    uint64_t slots[largest + 1];
+    bsonenum ret = BSON_SUCCESS;
+    for(i = 0; i < mph->buckets && ret == BSON_SUCCESS; i++) {
+	uint64_t b = bysize[i], len = start[b + 1] - start[b], p;
+	if(len == 0)
+	    break;
+	for(p = 0; p < MPH_PILOTS; p++) {
+	    for(j = 0; j < len; j++) {
+		slots[j] = bson_mph_slot(mph, order[start[b] + j], p);
+		if(taken[slots[j]])
+		    break;
+		for(k = 0; k < j && slots[k] != slots[j]; k++);
+		if(k != j)
+		    break;
+	    }
+	    if(j == len)
+		break;
+	}
+	if(p == MPH_PILOTS) {
+	    ret = BSON_CONTINUE;
+	    break;
+	}
+	mph->pilots[b] = (uint16_t)(p);
+	for(j = 0; j < len; j++)
+	    taken[slots[j]] = 1;
+    }
+
+    /* Fold the overflow slots back into the holes below keys */
+    if(ret == BSON_SUCCESS) {
+	uint64_t hole = 0;
+	for(i = n; i < mph->slots; i++) {
+	    if(!taken[i])
+		continue;
+	    while(taken[hole])
+		hole++;
+	    mph->remap[i - n] = (uint32_t)(hole++);
+	}
+    }
+
+    mph_untemp(&temp);
+    return ret;
+}
+
+bsonenum bson_mph_build(bsonmph *mph, bsonarena *arena, const uint64_t *hashes, uint64_t keys) {
+    memset(mph, 0, sizeof(bsonmph));
+    if(keys == 0)
+	return BSON_SUCCESS;
+    if(keys > UINT32_MAX)
+	return BSON_INVALID_VALUE;
+    mph->keys    = keys;
+    mph->slots   = (uint64_t)((double)(keys) / MPH_LOAD) + 1;
+    mph->buckets = (keys + MPH_BUCKET_SIZE - 1) / MPH_BUCKET_SIZE;
+    mph->pilots  = bsonarena_alloc(arena, mph->buckets * sizeof(uint16_t), sizeof(uint16_t));
+    mph->remap   = bsonarena_calloc(arena, (mph->slots - keys) * sizeof(uint32_t), sizeof(uint32_t));
+    if(mph->pilots == NULL || mph->remap == NULL) {
+	memset(mph, 0, sizeof(bsonmph));
+	return BSON_MEMORY;
+    }
+
+    bsonenum ret = BSON_CONTINUE;
+    int attempt;
+    for(attempt = 0; attempt < MPH_ATTEMPTS && ret == BSON_CONTINUE; attempt++) {
+	mph->seed = bson_mph_mix(0x5EEDULL + attempt);
+	memset(mph->pilots, 0, mph->buckets * sizeof(uint16_t));
+	ret = mph_search(mph, arena, hashes);
+    }
+    /* Still stuck after reseeding means two keys share a full 64 bit hash */
+    if(ret == BSON_CONTINUE)
+	ret = BSON_INVALID_VALUE;
+    if(ret != BSON_SUCCESS)
+	memset(mph, 0, sizeof(bsonmph));
+    return ret;
+}
+
+uint64_t bson_mph_bytes(const bsonmph *mph) {
+    if(mph->keys == 0)
+	return 0;
+    return mph->buckets * sizeof(uint16_t) + (mph->slots - mph->keys) * sizeof(uint32_t);
+}
@@ -0,0 +1,53 @@
+#ifndef _BSON_MPH_H_
+#define _BSON_MPH_H_
+
+#include <stdint.h>
+
+#include "bson.h"
+#include "allocator.h"
+
+/* PTHash style minimal perfect hash. Keys are split into buckets of about
+ * five, and each bucket gets the first 16 bit pilot that drops all of its
+ * keys into free slots of a table 2% larger than the key set. Slots past
+ * the end are remapped into the holes left below it, so every key ends up
+ * at a distinct position in [0, keys). */
+typedef struct {
+    uint64_t  keys;
+    uint64_t  slots;
+    uint64_t  buckets;
+    uint64_t  seed;
+    uint16_t *pilots;
+    uint32_t *remap;
+} bsonmph;
+
+bsonenum  bson_mph_build(bsonmph *mph, bsonarena *arena, const uint64_t *hashes, uint64_t keys);
+uint64_t  bson_mph_bytes(const bsonmph *mph);
+
+static inline uint64_t bson_mph_mix(uint64_t h) {
+    h ^= h >> 31;
+    h *= 0x7FB5D329728EA185ULL;
+    h ^= h >> 27;
+    h *= 0x81DADEF4BC2DD44DULL;
+    return h ^ (h >> 33);
+}
+
+static inline uint64_t bson_mph_bucket(const bsonmph *mph, uint64_t h) {
+    return ((h >> 32) * mph->buckets) >> 32;
+}
+
+static inline uint64_t bson_mph_slot(const bsonmph *mph, uint64_t h, uint64_t pilot) {
+    h = bson_mph_mix(h ^ (pilot * 0x9E3779B97F4A7C15ULL));
+    return ((h & 0xFFFFFFFF) * mph->slots) >> 32;
+}
+
+static inline uint64_t bson_mph_lookup(const bsonmph *mph, uint64_t hash) {
+    uint64_t h   = bson_mph_mix(hash ^ mph->seed);
+    uint64_t pos = bson_mph_slot(mph, h, mph->pilots[bson_mph_bucket(mph, h)]);
+    return pos < mph->keys ? pos : mph->remap[pos - mph->keys];
+}
+
+static inline void bson_mph_prefetch(const bsonmph *mph, uint64_t hash) {
+    __builtin_prefetch(&mph->pilots[bson_mph_bucket(mph, bson_mph_mix(hash ^ mph->seed))]);
+}
+
+#endif
@@ -0,0 +1,823 @@
+/* bsonc: checks, converts and measures documents from the shell.
+ *
+ *     bsonc check file...       parse every file, on all cores, errors as file:line
+ *     bsonc json file           the document as JSON on stdout
+ *     bsonc bson file.json|-    JSON as a document on stdout
+ *     bsonc stats file          what bson_stats() reports after loading
+ *     bsonc bench file [runs]   time bson_open() and lookups
+ *
+ * Both conversions stream: JSON is written from a visitor while the file
+ * parses and documents are written as the JSON is read. Dotted keys nest,
+ * single item arrays come out as plain values and records as an object of
+ * columns. Going the other way true and false become 1 and 0, and null and
+ * empty arrays are dropped, since a document cannot hold them. On an
+ * error the output stops where the input went wrong and the exit code is 1. */
+
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bson.h"
+
+#define BENCH_RUNS     20
+#define BENCH_LOOKUPS  2000000
+
+static uint64_t nanos(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+/*     CHECK     */
+
+typedef struct {
+    const char *path;
+    bsonenum    result;
+    uint64_t    line;
+    bsonticket *ticket;
+} checked_t;
+
+static void check_trace(const bsontrace *event, void *ud) {
+    checked_t *c = ud;
+    if(event->type == BSON_TRACE_ERROR)
+	c->line = event->line;
+}
+
+static void skip_value(const char *name, uint64_t hash, bsonenum type, void *items, void *ud) {
+}
+
+/* Opened with a visitor, so nothing gets indexed, on the bson_open_async()
+ * pool; reported in argument order */
+static int check(int files, char **paths) {
+    checked_t *checked = calloc(files, sizeof(checked_t));
+    int i, failed = 0;
+    if(checked == NULL)
+	return 1;
+    for(i = 0; i < files; i++) {
+	bsonopts opts;
+	memset(&opts, 0, sizeof(bsonopts));
+	opts.visit   = skip_value;
+	opts.trace   = check_trace;
+	opts.traceud = &checked[i];
+	checked[i].path   = paths[i];
+	checked[i].ticket = bson_open_async(paths[i], &opts, NULL, NULL, &checked[i].result);
+    }
+    for(i = 0; i < files; i++) {
+	checked_t *c = &checked[i];
+	if(c->ticket != NULL) {
+	    BSON *bson = bson_wait(c->ticket, &c->result);
+	    bson_free(&bson, NULL);
+	}
+	if(c->result == BSON_SUCCESS)
+	    continue;
+	failed++;
+	if(c->line > 0)
+	    fprintf(stderr, "%s:%llu: %s\n", c->path, (unsigned long long)(c->line), bson_res_str(c->result));
+	else
+	    fprintf(stderr, "%s: %s\n", c->path, bson_res_str(c->result));
+    }
+    if(failed)
+	fprintf(stderr, "%d of %d failed\n", failed, files);
+    free(checked);
+    return failed != 0;
+}
+
+/*               */
+
+
+/*   BSON JSON   */
+
+/* The objects currently open, as the dotted prefix of the last key */
+typedef struct {
+    FILE   *out;
+    char   *open;
+    size_t  len;
+    size_t  max;
+    size_t  depth;
+    int     first;
+    int     failed;
+} jsonout;
+
+static void write_json_string(FILE *out, const char *str, size_t len) {
+    size_t i;
+    fputc('"', out);
+    for(i = 0; i < len; i++) {
+	unsigned char c = str[i];
+	if(c == '"' || c == '\\')
+	    fprintf(out, "\\%c", c);
+	else if(c == '\n')
+	    fputs("\\n", out);
+	else if(c == '\t')
+	    fputs("\\t", out);
+	else if(c < 0x20)
+	    fprintf(out, "\\u%04x", c);
+	else
+	    fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+static void indent(FILE *out, size_t depth) {
+    size_t i;
+    for(i = 0; i <= depth; i++)
+	fputs("    ", out);
+}
+
+static void next_item(jsonout *j) {
+    fputs(j->first ? "\n" : ",\n", j->out);
+    j->first = 0;
+}
+
+/* A decimal has to keep looking like one to read back as a double */
+static void format_double(char *buf, size_t size, double d) {
+    snprintf(buf, size, "%.17g", d);
+    if(strpbrk(buf, ".n") != NULL)
+	return;
+    char *e = strchr(buf, 'e');
+    if(e == NULL) {
+	strcat(buf, ".0");
+	return;
+    }
+    memmove(e + 2, e, strlen(e) + 1);
+    e[0] = '.';
+    e[1] = '0';
+}
+
+static void write_json_item(FILE *out, bsonenum type, void *items, size_t i) {
+    char num[64];
+    switch(type) {
+	case BSON_INT:
+	    fprintf(out, "%lld", ((long long *)(items))[i]);
+	    break;
+	case BSON_DBL:
+	    if(!isfinite(((double *)(items))[i])) {
+		fputs("null", out);
+		break;
+	    }
+	    format_double(num, sizeof(num), ((double *)(items))[i]);
+	    fputs(num, out);
+	    break;
+	default:
+	    write_json_string(out, ((char **)(items))[i], strlen(((char **)(items))[i]));
+	    break;
+    }
+}
+
+/* How many whole segments the open objects share with the key's; *at is
+ * where the last shared one ends */
+static size_t shared_segments(const char *open, size_t openlen, const char *obj, size_t objlen, size_t *at) {
+    size_t segs = 0, i = 0, a;
+    *at = 0;
+    if(openlen == 0 || objlen == 0)
+	return 0;
+    for(;;) {
+	for(a = i; a < openlen && a < objlen && open[a] == obj[a] && open[a] != '.'; a++);
+	if((a < openlen && open[a] != '.') || (a < objlen && obj[a] != '.'))
+	    return segs;
+	segs++;
+	*at = a;
+	if(a == openlen || a == objlen)
+	    return segs;
+	i = a + 1;
+    }
+}
+
+/* Closes the objects the new key is not in and opens the ones it is. A
+ * key coming back to an object already closed opens it again, which JSON
+ * readers take as a repeated key. */
+static void json_key(const char *name, uint64_t hash, bsonenum type, void *items, void *ud) {
+    jsonout *j = ud;
+    const char *dot = strrchr(name, '.'), *seg, *end;
+    size_t objlen = dot != NULL ? (size_t)(dot - name) : 0, at, i;
+    size_t keep = shared_segments(j->open, j->len, name, objlen, &at);
+    for(; j->depth > keep; j->depth--) {
+	fputc('\n', j->out);
+	indent(j->out, j->depth - 1);
+	fputc('}', j->out);
+	j->first = 0;
+    }
+    for(seg = name + (keep > 0 ? at + 1 : 0); seg < name + objlen; seg = end + 1) {
+	end = memchr(seg, '.', name + objlen - seg);
+	if(end == NULL)
+	    end = name + objlen;
+	next_item(j);
+	indent(j->out, j->depth);
+	write_json_string(j->out, seg, end - seg);
+	fputs(": {", j->out);
+	j->depth++;
+	j->first = 1;
+    }
+    if(objlen + 1 > j->max) {
+	char *more = realloc(j->open, objlen + 64);
+	if(more == NULL) {
+	    j->failed = 1;
+	    return;
+	}
+	j->open = more;
+	j->max  = objlen + 64;
+    }
+    memcpy(j->open, name, objlen);
+    j->open[objlen] = '\0';
+    j->len = objlen;
+
+    const char *leaf = dot != NULL ? dot + 1 : name;
+    size_t len = bson_len(items);
+    next_item(j);
+    indent(j->out, j->depth);
+    write_json_string(j->out, leaf, strlen(leaf));
+    fputs(": ", j->out);
+    if(len == 1) {
+	write_json_item(j->out, type, items, 0);
+	return;
+    }
+    fputc('[', j->out);
+    for(i = 0; i < len; i++) {
+	fputs(i ? ", " : " ", j->out);
+	write_json_item(j->out, type, items, i);
+    }
+    fputs(" ]", j->out);
+}
+
+static int to_json(const char *path) {
+    jsonout j;
+    memset(&j, 0, sizeof(jsonout));
+    j.out   = stdout;
+    j.first = 1;
+    bsonopts opts;
+    memset(&opts, 0, sizeof(bsonopts));
+    opts.visit   = json_key;
+    opts.visitud = &j;
+    bsonenum res;
+    fputc('{', stdout);
+    BSON *bson = bson_open_opts(path, &opts, &res);
+    for(; j.depth > 0; j.depth--) {
+	fputc('\n', stdout);
+	indent(stdout, j.depth - 1);
+	fputc('}', stdout);
+    }
+    fputs("\n}\n", stdout);
+    free(j.open);
+    if(bson == NULL || j.failed) {
+	fprintf(stderr, "%s: %s\n", path, bson_res_str(j.failed ? BSON_MEMORY : res));
+	return 1;
+    }
+    bson_free(&bson, NULL);
+    return 0;
+}
+
+/*               */
+
+
+/*   JSON BSON   */
+
+/* Values are spelled into buf before they go out: a whole array (records
+ * included) has to be checked before its first item can be written */
+typedef struct {
+    FILE       *in;
+    const char *path;
+    uint64_t    line;
+    FILE       *out;
+    int         failed;
+    char       *buf;
+    size_t      len;
+    size_t      max;
+} jsonin;
+
+static int fail(jsonin *j, const char *what) {
+    if(!j->failed)
+	fprintf(stderr, "%s:%llu: %s\n", j->path, (unsigned long long)(j->line), what);
+    j->failed = 1;
+    return 0;
+}
+
+static int next_char(jsonin *j) {
+    int c = getc(j->in);
+    if(c == '\n')
+	j->line++;
+    return c;
+}
+
+/* The next character past whitespace, left unread */
+static int peek_token(jsonin *j) {
+    int c;
+    while((c = next_char(j)) != EOF && isspace(c));
+    if(c != EOF)
+	ungetc(c, j->in);
+    return c;
+}
+
+static int expect(jsonin *j, int want) {
+    if(peek_token(j) != want)
+	return fail(j, "unexpected character");
+    next_char(j);
+    return 1;
+}
+
+static int put_char(jsonin *j, char c) {
+    if(j->len + 1 >= j->max) {
+	size_t max = j->max ? j->max * 2 : 256;
+	char *more = realloc(j->buf, max);
+	if(more == NULL)
+	    return fail(j, "out of memory");
+	j->buf = more;
+	j->max = max;
+    }
+    j->buf[j->len++] = c;
+    j->buf[j->len] = '\0';
+    return 1;
+}
+
+static int put_str(jsonin *j, const char *s) {
+    while(*s) {
+	if(!put_char(j, *s++))
+	    return 0;
+    }
+    return 1;
+}
+
+static int put_indent(jsonin *j, int depth) {
+    int i;
+    for(i = 0; i < depth; i++) {
+	if(!put_str(j, "    "))
+	    return 0;
+    }
+    return 1;
+}
+
+static int put_utf8(jsonin *j, unsigned long cp) {
+    if(cp < 0x80)
+	return put_char(j, cp);
+    if(cp < 0x800)
+	return put_char(j, 0xC0 | (cp >> 6)) && put_char(j, 0x80 | (cp & 0x3F));
+    if(cp < 0x10000)
+	return put_char(j, 0xE0 | (cp >> 12)) && put_char(j, 0x80 | ((cp >> 6) & 0x3F)) && put_char(j, 0x80 | (cp & 0x3F));
+    return put_char(j, 0xF0 | (cp >> 18)) && put_char(j, 0x80 | ((cp >> 12) & 0x3F)) &&
+	   put_char(j, 0x80 | ((cp >> 6) & 0x3F)) && put_char(j, 0x80 | (cp & 0x3F));
+}
+
+static int read_hex4(jsonin *j, unsigned long *cp) {
+    int i, c;
+    *cp = 0;
+    for(i = 0; i < 4; i++) {
+	c = next_char(j);
+	if(!isxdigit(c))
+	    return fail(j, "bad \\u escape");
+	*cp = *cp * 16 + (isdigit(c) ? c - '0' : tolower(c) - 'a' + 10);
+    }
+    return 1;
+}
+
+static int read_escape(jsonin *j) {
+    unsigned long cp, low;
+    int c = next_char(j);
+    switch(c) {
+	case 'n': return put_char(j, '\n');
+	case 't': return put_char(j, '\t');
+	case 'r': return put_char(j, '\r');
+	case 'b': return put_char(j, '\b');
+	case 'f': return put_char(j, '\f');
+	case 'u': break;
+	default:  return put_char(j, c);
+    }
+    if(!read_hex4(j, &cp))
+	return 0;
+    if(cp >= 0xD800 && cp < 0xDC00) {
+	if(next_char(j) != '\\' || next_char(j) != 'u' || !read_hex4(j, &low) || low < 0xDC00 || low > 0xDFFF)
+	    return fail(j, "lone surrogate");
+	cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+    }
+    return put_utf8(j, cp);
+}
+
+/* Appends the string, unescaped. A document ends a string at the next
+ * quote and a value at the end of the line, so neither may be in one. */
+static int read_string(jsonin *j) {
+    size_t start = j->len;
+    int c;
+    if(!expect(j, '"'))
+	return 0;
+    while((c = next_char(j)) != '"') {
+	if(c == EOF)
+	    return fail(j, "unterminated string");
+	if(!(c == '\\' ? read_escape(j) : put_char(j, c)))
+	    return 0;
+    }
+    if(strpbrk(j->buf + start, "\"\n") != NULL)
+	return fail(j, "a document cannot hold quotes or newlines in a string");
+    return 1;
+}
+
+/* Appends the key. Keys end at whitespace, = or {, and would read as a
+ * comment or the end of an object starting with // or } */
+static int read_key(jsonin *j) {
+    size_t start = j->len, i;
+    if(!read_string(j))
+	return 0;
+    const char *key = j->buf + start;
+    if(j->len == start || key[0] == '}' || strncmp(key, "//", 2) == 0)
+	return fail(j, "key cannot be used in a document");
+    for(i = start; i < j->len; i++) {
+	if(isspace((unsigned char)(j->buf[i])) || j->buf[i] == '=' || j->buf[i] == '{')
+	    return fail(j, "key cannot be used in a document");
+    }
+    return expect(j, ':');
+}
+
+typedef enum { SCALAR_NONE, SCALAR_INT, SCALAR_DBL, SCALAR_STR } scalar;
+
+/* Appends a string, true, false or a number as the document spells it;
+ * SCALAR_NONE for null, or with j->failed set */
+static scalar read_scalar(jsonin *j) {
+    char tok[64];
+    size_t n = 0;
+    int c = peek_token(j);
+    if(c == '"')
+	return put_char(j, '"') && read_string(j) && put_char(j, '"') ? SCALAR_STR : SCALAR_NONE;
+    while((c = getc(j->in)) != EOF && (isalnum(c) || c == '-' || c == '+' || c == '.')) {
+	if(n + 1 >= sizeof(tok))
+	    return fail(j, "value too long");
+	tok[n++] = c;
+    }
+    if(c != EOF)
+	ungetc(c, j->in);
+    tok[n] = '\0';
+    if(strcmp(tok, "true") == 0 || strcmp(tok, "false") == 0)
+	return put_char(j, tok[0] == 't' ? '1' : '0') ? SCALAR_INT : SCALAR_NONE;
+    if(strcmp(tok, "null") == 0)
+	return SCALAR_NONE;
+    char *end;
+    errno = 0;
+    long long i = strtoll(tok, &end, 10);
+    if(n > 0 && *end == '\0' && errno == 0) {
+	snprintf(tok, sizeof(tok), "%lld", i);
+	return put_str(j, tok) ? SCALAR_INT : SCALAR_NONE;
+    }
+    double d = strtod(tok, &end);
+    if(n == 0 || *end != '\0')
+	return fail(j, "bad value");
+    format_double(tok, sizeof(tok), d);
+    return put_str(j, tok) ? SCALAR_DBL : SCALAR_NONE;
+}
+
+/* A document array holds one type, so integers among decimals get a .0 */
+static int widen_ints(jsonin *j, size_t start) {
+    char *items = strdup(j->buf + start), *tok, *save;
+    if(items == NULL)
+	return fail(j, "out of memory");
+    j->len = start;
+    j->buf[start] = '\0';
+    int ok = 1;
+    for(tok = strtok_r(items, ", ", &save); tok != NULL && ok; tok = strtok_r(NULL, ", ", &save)) {
+	ok = (j->len == start || put_str(j, ", ")) && put_str(j, tok) &&
+	     (strchr(tok, '.') != NULL || put_str(j, ".0"));
+    }
+    free(items);
+    return ok;
+}
+
+/* Flat objects only, fields that are null are left out */
+static int read_record(jsonin *j) {
+    if(!expect(j, '{') || !put_str(j, "{ "))
+	return 0;
+    if(peek_token(j) == '}') {
+	next_char(j);
+	return put_char(j, '}');
+    }
+    for(;;) {
+	size_t start = j->len;
+	if(!read_key(j) || !put_str(j, " = "))
+	    return 0;
+	int c = peek_token(j);
+	if(c == '{' || c == '[')
+	    return fail(j, "records can only hold plain values");
+	scalar s = read_scalar(j);
+	if(j->failed)
+	    return 0;
+	if(s == SCALAR_NONE) {
+	    j->len = start;
+	    j->buf[start] = '\0';
+	}
+	else if(!put_char(j, ' '))
+	    return 0;
+	c = peek_token(j);
+	next_char(j);
+	if(c == '}')
+	    return put_char(j, '}');
+	if(c != ',')
+	    return fail(j, "expected , or }");
+    }
+}
+
+/* Values go out on one line, records one per line */
+static int read_array(jsonin *j, const char *key, int depth) {
+    scalar kind = SCALAR_NONE;
+    int records = 0, items = 0, c;
+    if(!expect(j, '['))
+	return 0;
+    j->len = 0;
+    if(peek_token(j) == ']') {
+	next_char(j);
+	return 1;
+    }
+    for(;; items++) {
+	c = peek_token(j);
+	if(c == '[')
+	    return fail(j, "a document cannot nest arrays");
+	if(c == '{' ? items > records : records > 0)
+	    return fail(j, "an array cannot mix records and values");
+	if(c == '{') {
+	    if((items > 0 && !put_char(j, '\n')) || !put_indent(j, depth + 1) || !read_record(j))
+		return 0;
+	    records++;
+	}
+	else {
+	    if(items > 0 && !put_str(j, ", "))
+		return 0;
+	    scalar s = read_scalar(j);
+	    if(j->failed)
+		return 0;
+	    if(s == SCALAR_NONE)
+		return fail(j, "a document array cannot hold null");
+	    if(kind != SCALAR_NONE && (kind == SCALAR_STR) != (s == SCALAR_STR))
+		return fail(j, "an array cannot mix strings and numbers");
+	    if(kind != SCALAR_DBL)
+		kind = s;
+	}
+	c = peek_token(j);
+	next_char(j);
+	if(c == ']')
+	    break;
+	if(c != ',')
+	    return fail(j, "expected , or ]");
+    }
+    if(kind == SCALAR_DBL && !widen_ints(j, 0))
+	return 0;
+    fprintf(j->out, "%*s%s = [", depth * 4, "", key);
+    if(records)
+	fprintf(j->out, "\n%s\n%*s]\n", j->buf, depth * 4, "");
+    else
+	fprintf(j->out, " %s ]\n", j->buf);
+    return 1;
+}
+
+static int read_object(jsonin *j, int depth);
+
+static int read_member(jsonin *j, int depth) {
+    j->len = 0;
+    if(!read_key(j))
+	return 0;
+    char *key = strdup(j->buf);
+    if(key == NULL)
+	return fail(j, "out of memory");
+    int ok = 1, c = peek_token(j);
+    if(c == '{') {
+	fprintf(j->out, "%*s%s {\n", depth * 4, "", key);
+	ok = read_object(j, depth + 1);
+	if(ok)
+	    fprintf(j->out, "%*s}\n", depth * 4, "");
+    }
+    else if(c == '[')
+	ok = read_array(j, key, depth);
+    else {
+	j->len = 0;
+	if(read_scalar(j) != SCALAR_NONE)
+	    fprintf(j->out, "%*s%s = %s\n", depth * 4, "", key, j->buf);
+	ok = !j->failed;
+    }
+    free(key);
+    return ok;
+}
+
+static int read_object(jsonin *j, int depth) {
+    if(!expect(j, '{'))
+	return 0;
+    if(peek_token(j) == '}') {
+	next_char(j);
+	return 1;
+    }
+    for(;;) {
+	if(!read_member(j, depth))
+	    return 0;
+	int c = peek_token(j);
+	next_char(j);
+	if(c == '}')
+	    return 1;
+	if(c != ',')
+	    return fail(j, "expected , or }");
+    }
+}
+
+static int to_bson(const char *path) {
+    jsonin j;
+    memset(&j, 0, sizeof(jsonin));
+    j.path = path;
+    j.line = 1;
+    j.out  = stdout;
+    j.in   = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if(j.in == NULL) {
+	fprintf(stderr, "%s: %s\n", path, strerror(errno));
+	return 1;
+    }
+    int ok = read_object(&j, 0);
+    if(ok && peek_token(&j) != EOF)
+	ok = fail(&j, "trailing characters");
+    if(j.in != stdin)
+	fclose(j.in);
+    free(j.buf);
+    return !ok;
+}
+
+/*               */
+
+
+/*  STATS BENCH  */
+
+static BSON *open_or_say(const char *path, const bsonopts *opts) {
+    bsonenum res;
+    BSON *bson = bson_open_opts(path, opts, &res);
+    if(bson == NULL)
+	fprintf(stderr, "%s: %s\n", path, bson_res_str(res));
+    return bson;
+}
+
+static void print_stats(const bsonstats *s) {
+    int i;
+    printf("keys          %llu\n", (unsigned long long)(s->keys));
+    printf("lines         %llu\n", (unsigned long long)(s->lines));
+    printf("bytes read    %llu", (unsigned long long)(s->bytesread));
+    if(s->packedbytes > 0)
+	printf(" (%llu compressed)", (unsigned long long)(s->packedbytes));
+    printf("\nread          %.3f ms\n", s->iotime / 1e6);
+    printf("parse         %.3f ms\n", s->parsetime / 1e6);
+    printf("index         %.3f ms\n", s->indextime / 1e6);
+    printf("arena         %llu allocations, %llu bytes\n", (unsigned long long)(s->allocs), (unsigned long long)(s->allocbytes));
+    printf("heap          %llu allocations, %llu bytes\n", (unsigned long long)(s->heapallocs), (unsigned long long)(s->heapbytes));
+    printf("interned      %llu bytes saved\n", (unsigned long long)(s->internsaved));
+    printf("includes      %llu (%llu cached)\n", (unsigned long long)(s->includes), (unsigned long long)(s->includehits));
+    printf("buckets       %llu, load %.2f\n", (unsigned long long)(s->buckets), s->loadfactor);
+    printf("chains        ");
+    for(i = 0; i < BSON_CHAIN_BINS; i++)
+	printf("%s%llu", i ? " " : "", (unsigned long long)(s->chains[i]));
+    printf("\nbloom         %llu bits, %.4f estimated false positives\n", (unsigned long long)(s->bloombits), s->bloomfprest);
+    printf("index bytes   %llu\n", (unsigned long long)(s->indexbytes));
+}
+
+static int stats(const char *path) {
+    BSON *bson = open_or_say(path, NULL);
+    if(bson == NULL)
+	return 1;
+    bsonstats s;
+    bson_stats(bson, &s);
+    print_stats(&s);
+    printf("fingerprint   %016llx\n", (unsigned long long)(bson_fingerprint(bson, NULL)));
+    if(bson_freeze(bson) == BSON_SUCCESS) {
+	bson_stats(bson, &s);
+	printf("frozen        %llu index bytes, %.3f ms\n", (unsigned long long)(s.indexbytes), s.freezetime / 1e6);
+    }
+    bson_free(&bson, NULL);
+    return 0;
+}
+
+typedef struct {
+    char     **names;
+    uint64_t  *hashes;
+    size_t     count;
+    size_t     max;
+    int        failed;
+} keys_t;
+
+static void collect_key(const char *name, uint64_t hash, bsonenum type, void *items, void *ud) {
+    keys_t *k = ud;
+    if(k->failed)
+	return;
+    if(k->count == k->max) {
+	size_t max = k->max ? k->max * 2 : 256;
+	char **names = realloc(k->names, max * sizeof(char *));
+	uint64_t *hashes = names == NULL ? NULL : realloc(k->hashes, max * sizeof(uint64_t));
+	if(names != NULL)
+	    k->names = names;
+	if(hashes == NULL) {
+	    k->failed = 1;
+	    return;
+	}
+	k->hashes = hashes;
+	k->max    = max;
+    }
+    if((k->names[k->count] = strdup(name)) == NULL) {
+	k->failed = 1;
+	return;
+    }
+    k->hashes[k->count++] = hash;
+}
+
+static int compare_nanos(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)(a), y = *(const uint64_t *)(b);
+    return (x > y) - (x < y);
+}
+
+/* Every key in turn, until about BENCH_LOOKUPS are done; returns ns each */
+static double time_lookups(BSON *bson, const keys_t *k, int prehashed, int missing) {
+    size_t rounds = BENCH_LOOKUPS / k->count + 1, r, i;
+    uintptr_t sink = 0;
+    bsonenum type;
+    uint64_t start = nanos();
+    for(r = 0; r < rounds; r++) {
+	for(i = 0; i < k->count; i++) {
+	    if(missing)
+		sink += (uintptr_t)(bson_find(bson, k->names[i], k->hashes[i] ^ 1, &type));
+	    else if(prehashed)
+		sink += (uintptr_t)(bson_find(bson, k->names[i], k->hashes[i], &type));
+	    else
+		sink += (uintptr_t)(bson_find(bson, k->names[i], bson_key_hash(k->names[i]), &type));
+	}
+    }
+    uint64_t spent = nanos() - start;
+    if(sink == 1)
+	putchar(' ');
+    return (double)(spent) / (double)(rounds * k->count);
+}
+
+static int bench(const char *path, int runs) {
+    keys_t k;
+    memset(&k, 0, sizeof(keys_t));
+    bsonopts opts;
+    memset(&opts, 0, sizeof(bsonopts));
+    opts.visit   = collect_key;
+    opts.visitud = &k;
+    BSON *visited = open_or_say(path, &opts);
+    int failed = visited == NULL || k.failed;
+    bson_free(&visited, NULL);
+
+    uint64_t *times = calloc(runs, sizeof(uint64_t));
+    int i;
+    failed |= times == NULL;
+    for(i = 0; !failed && i < runs; i++) {
+	uint64_t start = nanos();
+	BSON *bson = open_or_say(path, NULL);
+	times[i] = nanos() - start;
+	failed = bson == NULL;
+	bson_free(&bson, NULL);
+    }
+    if(!failed) {
+	qsort(times, runs, sizeof(uint64_t), compare_nanos);
+	printf("bson_open     min %.3f ms, median %.3f ms over %d runs\n", times[0] / 1e6, times[runs / 2] / 1e6, runs);
+    }
+    free(times);
+
+    BSON *bson = failed ? NULL : open_or_say(path, NULL);
+    failed |= bson == NULL;
+    if(!failed && k.count > 0) {
+	printf("lookup        %.1f ns hashed on call, %.1f ns prehashed, %.1f ns missing\n",
+	       time_lookups(bson, &k, 0, 0), time_lookups(bson, &k, 1, 0), time_lookups(bson, &k, 1, 1));
+	if(bson_freeze(bson) == BSON_SUCCESS)
+	    printf("frozen        %.1f ns hashed on call, %.1f ns prehashed, %.1f ns missing\n",
+		   time_lookups(bson, &k, 0, 0), time_lookups(bson, &k, 1, 0), time_lookups(bson, &k, 1, 1));
+    }
+    else if(!failed)
+	printf("lookup        no keys\n");
+    size_t n;
+    for(n = 0; n < k.count; n++)
+	free(k.names[n]);
+    free(k.names);
+    free(k.hashes);
+    bson_free(&bson, NULL);
+    return failed;
+}
+
+/*               */
+
+
+static int usage(void) {
+    fprintf(stderr,
+	"usage: bsonc check file...\n"
+	"       bsonc json file\n"
+	"       bsonc bson file.json|-\n"
+	"       bsonc stats file\n"
+	"       bsonc bench file [runs]\n");
+    return 2;
+}
+
+int main(int argc, char **argv) {
+    if(argc < 3)
+	return usage();
+    const char *cmd = argv[1];
+    if(strcmp(cmd, "check") == 0)
+	return check(argc - 2, argv + 2);
+    if(argc > 4 || (argc == 4 && strcmp(cmd, "bench") != 0))
+	return usage();
+    if(strcmp(cmd, "json") == 0)
+	return to_json(argv[2]);
+    if(strcmp(cmd, "bson") == 0)
+	return to_bson(argv[2]);
+    if(strcmp(cmd, "stats") == 0)
+	return stats(argv[2]);
+    if(strcmp(cmd, "bench") == 0) {
+	int runs = argc == 4 ? atoi(argv[3]) : BENCH_RUNS;
+	return bench(argv[2], runs > 0 ? runs : BENCH_RUNS);
+    }
+    return usage();
+}
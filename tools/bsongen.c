@@ -0,0 +1,274 @@
+/* bsongen: binds the keys of a sample document to a C struct.
+ *
+ *     bsongen sample.bson name [outdir]
+ *
+ * writes name.h, holding a struct called name with one field per key of
+ * the sample, and name.c, holding name_load(). The loader parses a file
+ * once, handing each value straight to a switch over the hashes of the
+ * known keys (computed here), so nothing is indexed. Keys the file lacks
+ * or holds with another type are reported through a callback. A key that
+ * is a one item array in the sample becomes a plain field, anything
+ * longer a pointer and a _len. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "bson.h"
+
+typedef struct {
+    char     *key;
+    char     *field;
+    bsonenum  type;
+    size_t    len;
+    uint64_t  hash;
+} field_t;
+
+typedef struct {
+    field_t  *fields;
+    size_t    count;
+    size_t    max;
+    int       failed;
+} sample_t;
+
+/* A key seen again (the later value wins in a document) keeps its place */
+static void collect(const char *name, uint64_t hash, bsonenum type, void *items, void *ud) {
+    sample_t *s = ud;
+    size_t i;
+    for(i = 0; i < s->count; i++) {
+	if(s->fields[i].hash == hash && strcmp(s->fields[i].key, name) == 0)
+	    break;
+    }
+    if(i == s->count) {
+	if(s->count == s->max) {
+	    size_t max = s->max ? s->max * 2 : 64;
+	    field_t *more = realloc(s->fields, max * sizeof(field_t));
+	    if(more == NULL) {
+		s->failed = 1;
+		return;
+	    }
+	    s->fields = more;
+	    s->max    = max;
+	}
+	memset(&s->fields[i], 0, sizeof(field_t));
+	s->fields[i].key = strdup(name);
+	if(s->fields[i].key == NULL) {
+	    s->failed = 1;
+	    return;
+	}
+	s->fields[i].hash = hash;
+	s->count++;
+    }
+    s->fields[i].type = type;
+    s->fields[i].len  = bson_len(items);
+}
+
+/* texture.grid-size becomes texture_grid_size, clashes get a number */
+static int name_fields(sample_t *s) {
+    size_t i, j, len;
+    for(i = 0; i < s->count; i++) {
+	len = strlen(s->fields[i].key);
+	char *f = malloc(len + 24);
+	if(f == NULL)
+	    return 0;
+	char *at = f;
+	if(!isalpha((unsigned char)(s->fields[i].key[0])))
+	    *at++ = '_';
+	for(j = 0; j < len; j++)
+	    *at++ = isalnum((unsigned char)(s->fields[i].key[j])) ? s->fields[i].key[j] : '_';
+	*at = '\0';
+	for(j = 0; j < i; j++) {
+	    if(strcmp(s->fields[j].field, f) == 0) {
+		sprintf(at, "_%zu", i);
+		break;
+	    }
+	}
+	s->fields[i].field = f;
+	for(j = 0; j < i; j++) {
+	    if(s->fields[j].hash == s->fields[i].hash) {
+		fprintf(stderr, "bsongen: \"%s\" and \"%s\" share a hash\n", s->fields[j].key, s->fields[i].key);
+		return 0;
+	    }
+	}
+    }
+    return 1;
+}
+
+static const char *ctype(bsonenum type) {
+    switch(type) {
+	case BSON_INT: return "long long";
+	case BSON_DBL: return "double";
+	default:       return "char *";
+    }
+}
+
+static const char *enumname(bsonenum type) {
+    switch(type) {
+	case BSON_INT: return "BSON_INT";
+	case BSON_DBL: return "BSON_DBL";
+	default:       return "BSON_STR";
+    }
+}
+
+static void write_string(FILE *out, const char *str) {
+    fputc('"', out);
+    for(; *str; str++) {
+	if(*str == '"' || *str == '\\')
+	    fputc('\\', out);
+	fputc(*str, out);
+    }
+    fputc('"', out);
+}
+
+static void write_header(FILE *out, const sample_t *s, const char *name, const char *sample) {
+    size_t i;
+    fprintf(out, "/* Generated by bsongen from %s, do not edit */\n", sample);
+    fprintf(out, "#ifndef _%s_H_\n#define _%s_H_\n\n", name, name);
+    fprintf(out, "#include <stddef.h>\n\n#include \"bson.h\"\n\n");
+    fprintf(out, "/* Pointers point into the document %s_load() returns */\n", name);
+    fprintf(out, "typedef struct {\n");
+    for(i = 0; i < s->count; i++) {
+	const field_t *f = &s->fields[i];
+	const char *t = ctype(f->type);
+	int star = f->type == BSON_STR;
+	if(f->len == 1)
+	    fprintf(out, "    %-10s %s%s;\n", star ? "char" : t, star ? "*" : "", f->field);
+	else
+	    fprintf(out, "    %-10s %s*%s;\n    size_t     %s_len;\n", star ? "char" : t, star ? "*" : "", f->field, f->field);
+    }
+    fprintf(out, "} %s;\n\n", name);
+    fprintf(out, "typedef void (*%s_pfn_problem)(const char *key, bsonenum what, void *ud);\n\n", name);
+    fprintf(out, "/* Missing keys are passed to problem as BSON_NOT_FOUND, mistyped ones as\n");
+    fprintf(out, " * BSON_INVALID_VALUE, and the first problem becomes the result. The\n");
+    fprintf(out, " * returned document owns the values, bson_free() it when done. */\n");
+    fprintf(out, "BSON *%s_load(const char *path, %s *out, %s_pfn_problem problem, void *ud, bsonenum *result);\n\n", name, name, name);
+    fprintf(out, "#endif\n");
+}
+
+static void write_source(FILE *out, const sample_t *s, const char *name, const char *sample) {
+    size_t i;
+    fprintf(out, "/* Generated by bsongen from %s, do not edit */\n", sample);
+    fprintf(out, "#include <string.h>\n\n#include \"%s.h\"\n\n", name);
+    fprintf(out, "#define KEYS %zu\n\n", s->count);
+    fprintf(out, "static const char *const keys[KEYS] = {\n");
+    for(i = 0; i < s->count; i++) {
+	fprintf(out, "    ");
+	write_string(out, s->fields[i].key);
+	fprintf(out, ",\n");
+    }
+    fprintf(out, "};\n\n");
+    fprintf(out,
+	"typedef struct {\n"
+	"    %s *out;\n"
+	"    %s_pfn_problem problem;\n"
+	"    void *ud;\n"
+	"    bsonenum result;\n"
+	"    unsigned char seen[KEYS];\n"
+	"} state;\n\n", name, name);
+    fprintf(out,
+	"static void report(state *st, int key, bsonenum what) {\n"
+	"    if(st->result == BSON_SUCCESS)\n"
+	"\tst->result = what;\n"
+	"    if(st->problem != NULL)\n"
+	"\tst->problem(keys[key], what, st->ud);\n"
+	"}\n\n");
+    fprintf(out, "static void visit(const char *name, uint64_t hash, bsonenum type, void *items, void *ud) {\n");
+    fprintf(out, "    state *st = ud;\n    switch(hash) {\n");
+    for(i = 0; i < s->count; i++) {
+	const field_t *f = &s->fields[i];
+	fprintf(out, "\tcase 0x%016llXULL:\n", (unsigned long long)(f->hash));
+	fprintf(out, "\t    if(strcmp(name, keys[%zu]) != 0)\n\t\treturn;\n", i);
+	fprintf(out, "\t    st->seen[%zu] = 1;\n", i);
+	if(f->len == 1) {
+	    fprintf(out, "\t    if(type != %s || bson_len(items) != 1) {\n\t\treport(st, %zu, BSON_INVALID_VALUE);\n\t\treturn;\n\t    }\n", enumname(f->type), i);
+	    fprintf(out, "\t    st->out->%s = *(%s%s*)(items);\n", f->field, ctype(f->type), f->type == BSON_STR ? "" : " ");
+	}
+	else {
+	    fprintf(out, "\t    if(type != %s) {\n\t\treport(st, %zu, BSON_INVALID_VALUE);\n\t\treturn;\n\t    }\n", enumname(f->type), i);
+	    fprintf(out, "\t    st->out->%s = items;\n", f->field);
+	    fprintf(out, "\t    st->out->%s_len = bson_len(items);\n", f->field);
+	}
+	fprintf(out, "\t    return;\n");
+    }
+    fprintf(out, "    }\n}\n\n");
+    fprintf(out,
+	"BSON *%s_load(const char *path, %s *out, %s_pfn_problem problem, void *ud, bsonenum *result) {\n"
+	"    state st;\n"
+	"    memset(&st, 0, sizeof(state));\n"
+	"    memset(out, 0, sizeof(%s));\n"
+	"    st.out     = out;\n"
+	"    st.problem = problem;\n"
+	"    st.ud      = ud;\n"
+	"    st.result  = BSON_SUCCESS;\n"
+	"    bsonopts opts;\n"
+	"    memset(&opts, 0, sizeof(bsonopts));\n"
+	"    opts.visit   = visit;\n"
+	"    opts.visitud = &st;\n"
+	"    BSON *bson = bson_open_opts(path, &opts, result);\n"
+	"    if(bson == NULL)\n"
+	"\treturn NULL;\n"
+	"    int i;\n"
+	"    for(i = 0; i < KEYS; i++) {\n"
+	"\tif(!st.seen[i])\n"
+	"\t    report(&st, i, BSON_NOT_FOUND);\n"
+	"    }\n"
+	"    if(result != NULL)\n"
+	"\t*result = st.result;\n"
+	"    return bson;\n"
+	"}\n", name, name, name, name);
+}
+
+static FILE *open_out(const char *dir, const char *name, const char *ext) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s.%s", dir, name, ext);
+    FILE *f = fopen(path, "w");
+    if(f == NULL)
+	fprintf(stderr, "bsongen: cannot write %s\n", path);
+    return f;
+}
+
+int main(int argc, char **argv) {
+    if(argc < 3 || argc > 4) {
+	fprintf(stderr, "usage: bsongen sample.bson name [outdir]\n");
+	return 2;
+    }
+    const char *sample = argv[1], *name = argv[2], *dir = argc == 4 ? argv[3] : ".";
+    size_t i;
+    for(i = 0; name[i]; i++) {
+	if(!isalnum((unsigned char)(name[i])) && name[i] != '_')
+	    break;
+    }
+    if(name[i] || isdigit((unsigned char)(name[0]))) {
+	fprintf(stderr, "bsongen: %s is not a C identifier\n", name);
+	return 2;
+    }
+
+    sample_t s;
+    memset(&s, 0, sizeof(sample_t));
+    bsonopts opts;
+    memset(&opts, 0, sizeof(bsonopts));
+    opts.visit   = collect;
+    opts.visitud = &s;
+    bsonenum res;
+    BSON *bson = bson_open_opts(sample, &opts, &res);
+    if(bson == NULL || s.failed) {
+	fprintf(stderr, "bsongen: %s: %s\n", sample, bson_res_str(s.failed ? BSON_MEMORY : res));
+	return 1;
+    }
+    bson_free(&bson, &res);
+    if(s.count == 0 || !name_fields(&s)) {
+	if(s.count == 0)
+	    fprintf(stderr, "bsongen: %s has no keys\n", sample);
+	return 1;
+    }
+
+    FILE *h = open_out(dir, name, "h"), *c = open_out(dir, name, "c");
+    if(h == NULL || c == NULL)
+	return 1;
+    write_header(h, &s, name, sample);
+    write_source(c, &s, name, sample);
+    fclose(h);
+    fclose(c);
+    return 0;
+}
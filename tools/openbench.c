@@ -0,0 +1,130 @@
+/* openbench: startup with many documents, one after the other against
+ * bson_open_async().
+ *
+ *     openbench [file.bson ...]
+ *
+ * Without files it writes 30 generated configs to a temporary directory.
+ * The last two runs add 50ms of other initialization that blocks (say on
+ * a connection), which the async opens get to overlap with. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bson.h"
+
+#define FILES       30
+#define GROUPS      40
+#define OTHER_WORK  50000
+
+static uint64_t nanos(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+static int generate(char *dir, char **paths) {
+    int i, g, k;
+    if(mkdtemp(dir) == NULL)
+	return 0;
+    for(i = 0; i < FILES; i++) {
+	paths[i] = malloc(strlen(dir) + 32);
+	sprintf(paths[i], "%s/service%02d.bson", dir, i);
+	FILE *f = fopen(paths[i], "w");
+	if(f == NULL)
+	    return 0;
+	for(g = 0; g < GROUPS; g++) {
+	    fprintf(f, "section%d {\n", g);
+	    for(k = 0; k < 25; k++)
+		fprintf(f, "    option%d = %d\n    label%d = \"value %d\"\n", k, g * k, k, k % 7);
+	    fprintf(f, "    weights = [ 0.5, 1.5, 2.5, 3.5, 4.5, 5.5, 6.5, 7.5 ]\n}\n");
+	}
+	fclose(f);
+    }
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    char dir[] = "/tmp/openbenchXXXXXX";
+    char *generated[FILES];
+    char **paths = argv + 1;
+    int files = argc - 1, i;
+    if(files == 0) {
+	if(!generate(dir, generated)) {
+	    fprintf(stderr, "openbench: cannot write to %s\n", dir);
+	    return 1;
+	}
+	paths = generated;
+	files = FILES;
+    }
+
+    BSON **docs = calloc(files, sizeof(BSON *));
+    bsonticket **tickets = calloc(files, sizeof(bsonticket *));
+    bsonopts opts;
+    memset(&opts, 0, sizeof(bsonopts));
+    opts.maxkeys = 4096;
+    bsonenum res;
+    int failed = 0;
+
+    /* Warm the page cache and the pool, so both runs read the same way */
+    for(i = 0; i < files; i++) {
+	docs[i] = bson_open_opts(paths[i], &opts, &res);
+	bson_free(&docs[i], &res);
+    }
+    bson_wait(bson_open_async(paths[0], &opts, NULL, NULL, &res), &res);
+
+    uint64_t start = nanos();
+    for(i = 0; i < files; i++)
+	failed += (docs[i] = bson_open_opts(paths[i], &opts, &res)) == NULL;
+    uint64_t serial = nanos() - start;
+    for(i = 0; i < files; i++)
+	bson_free(&docs[i], &res);
+
+    start = nanos();
+    for(i = 0; i < files; i++)
+	tickets[i] = bson_open_async(paths[i], &opts, NULL, NULL, &res);
+    for(i = 0; i < files; i++)
+	failed += (docs[i] = bson_wait(tickets[i], &res)) == NULL;
+    uint64_t async = nanos() - start;
+    for(i = 0; i < files; i++)
+	bson_free(&docs[i], &res);
+
+    start = nanos();
+    for(i = 0; i < files; i++)
+	docs[i] = bson_open_opts(paths[i], &opts, &res);
+    usleep(OTHER_WORK);
+    uint64_t serialwork = nanos() - start;
+    for(i = 0; i < files; i++)
+	bson_free(&docs[i], &res);
+
+    start = nanos();
+    for(i = 0; i < files; i++)
+	tickets[i] = bson_open_async(paths[i], &opts, NULL, NULL, &res);
+    usleep(OTHER_WORK);
+    for(i = 0; i < files; i++)
+	docs[i] = bson_wait(tickets[i], &res);
+    uint64_t asyncwork = nanos() - start;
+    for(i = 0; i < files; i++)
+	bson_free(&docs[i], &res);
+
+    printf("%d files, %ld cores\n", files, sysconf(_SC_NPROCESSORS_ONLN));
+    printf("serial             %7.2f ms\n", serial / 1e6);
+    printf("async              %7.2f ms\n", async / 1e6);
+    printf("serial + 50ms wait %7.2f ms\n", serialwork / 1e6);
+    printf("async  + 50ms wait %7.2f ms\n", asyncwork / 1e6);
+    if(failed)
+	printf("%d opens failed\n", failed);
+
+    if(paths == generated) {
+	for(i = 0; i < files; i++) {
+	    unlink(generated[i]);
+	    free(generated[i]);
+	}
+	rmdir(dir);
+    }
+    free(docs);
+    free(tickets);
+    return failed != 0;
+}
@@ -0,0 +1,164 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "unpack.h"
+
+#define PACKED_BYTES UNPACK_SLOTBYTES
+#define RING_BYTES   (UNPACK_SLOTS * UNPACK_SLOTBYTES + PACKED_BYTES)
+
+/* gzip's magic, or a deflate zlib header with one of the four levels zlib
+ * writes and no preset dictionary; that keeps plain text out, bar a file
+ * starting with x^ */
+int bson_unpack_detect(const unsigned char *head, uint64_t len) {
+    if(len < 2)
+	return 0;
+    if(head[0] == 0x1F && head[1] == 0x8B)
+	return 1;
+    return head[0] == 0x78 && (head[1] == 0x01 || head[1] == 0x5E || head[1] == 0x9C || head[1] == 0xDA);
+}
+
+static voidpf unpack_alloc(voidpf ud, uInt items, uInt size) {
+    return bsonmalloc((size_t)(items) * size);
+}
+
+static void unpack_free(voidpf ud, voidpf ptr) {
+    bsonfree(ptr);
+}
+
+/* Waits for a free slot; 0 once the reader gave up */
+static int claim_slot(bsonunpack *u) {
+    pthread_mutex_lock(&u->lock);
+    while(u->tail - u->head == UNPACK_SLOTS && !u->stop)
+	pthread_cond_wait(&u->drained, &u->lock);
+    int stop = u->stop;
+    pthread_mutex_unlock(&u->lock);
+    return !stop;
+}
+
+static void publish_slot(bsonunpack *u, uint64_t len, int done, int failed) {
+    pthread_mutex_lock(&u->lock);
+    if(len > 0) {
+	u->lens[u->tail % UNPACK_SLOTS] = len;
+	u->tail++;
+    }
+    u->done   = done;
+    u->failed = failed;
+    pthread_cond_signal(&u->filled);
+    pthread_mutex_unlock(&u->lock);
+}
+
+/* Concatenated gzip members are one stream, as with gunzip */
+static void *unpack_thread(void *arg) {
+    bsonunpack *u = arg;
+    unsigned char *packed = (unsigned char *)(u->ring) + UNPACK_SLOTS * UNPACK_SLOTBYTES;
+    z_stream zs;
+    memset(&zs, 0, sizeof(z_stream));
+    zs.zalloc = unpack_alloc;
+    zs.zfree  = unpack_free;
+    if(inflateInit2(&zs, 15 + 32) != Z_OK) {
+	publish_slot(u, 0, 1, 1);
+	return NULL;
+    }
+    int ended = 0, done = 0, failed = 0;
+    while(!done && claim_slot(u)) {
+	char *slot = u->ring + (u->tail % UNPACK_SLOTS) * UNPACK_SLOTBYTES;
+	zs.next_out  = (unsigned char *)(slot);
+	zs.avail_out = UNPACK_SLOTBYTES;
+	while(zs.avail_out > 0 && !done) {
+	    if(zs.avail_in == 0) {
+		ssize_t got = read(u->fd, packed, PACKED_BYTES);
+		if(got < 0 && errno == EINTR)
+		    continue;
+		if(got <= 0) {
+		    /* Running out in the middle of a member is truncation */
+		    failed = got < 0 || !ended;
+		    done = 1;
+		    break;
+		}
+		u->packed   += got;
+		zs.next_in  = packed;
+		zs.avail_in = got;
+	    }
+	    if(ended) {
+		if(inflateReset(&zs) != Z_OK) {
+		    failed = done = 1;
+		    break;
+		}
+		ended = 0;
+	    }
+	    int ret = inflate(&zs, Z_NO_FLUSH);
+	    if(ret == Z_STREAM_END)
+		ended = 1;
+	    else if(ret != Z_OK && ret != Z_BUF_ERROR)
+		failed = done = 1;
+	}
+	publish_slot(u, UNPACK_SLOTBYTES - zs.avail_out, done, failed);
+    }
+    inflateEnd(&zs);
+    return NULL;
+}
+
+int bson_unpack_start(bsonunpack *u, bsonarena *arena, int fd) {
+    memset(u, 0, sizeof(bsonunpack));
+    u->fd    = fd;
+    u->arena = arena;
+    u->ring  = bsonarena_temp(arena, RING_BYTES);
+    if(u->ring == NULL)
+	return 0;
+    pthread_mutex_init(&u->lock, NULL);
+    pthread_cond_init(&u->filled, NULL);
+    pthread_cond_init(&u->drained, NULL);
+    if(pthread_create(&u->thread, NULL, unpack_thread, u) != 0) {
+	pthread_cond_destroy(&u->drained);
+	pthread_cond_destroy(&u->filled);
+	pthread_mutex_destroy(&u->lock);
+	bsonarena_untemp(arena, u->ring, RING_BYTES);
+	u->ring = NULL;
+	return 0;
+    }
+    return 1;
+}
+
+/* The head slot belongs to the reader until it hands it back, so the copy
+ * happens outside the lock */
+ssize_t bson_unpack_read(bsonunpack *u, char *dst, uint64_t max) {
+    pthread_mutex_lock(&u->lock);
+    while(u->head == u->tail && !u->done)
+	pthread_cond_wait(&u->filled, &u->lock);
+    if(u->head == u->tail) {
+	int failed = u->failed;
+	pthread_mutex_unlock(&u->lock);
+	return failed ? -1 : 0;
+    }
+    uint64_t slot = u->head % UNPACK_SLOTS, len = u->lens[slot];
+    pthread_mutex_unlock(&u->lock);
+
+    uint64_t n = len - u->pos < max ? len - u->pos : max;
+    memcpy(dst, u->ring + slot * UNPACK_SLOTBYTES + u->pos, n);
+    u->pos += n;
+    if(u->pos == len) {
+	pthread_mutex_lock(&u->lock);
+	u->head++;
+	u->pos = 0;
+	pthread_cond_signal(&u->drained);
+	pthread_mutex_unlock(&u->lock);
+    }
+    return n;
+}
+
+void bson_unpack_stop(bsonunpack *u) {
+    if(u->ring == NULL)
+	return;
+    pthread_mutex_lock(&u->lock);
+    u->stop = 1;
+    pthread_cond_signal(&u->drained);
+    pthread_mutex_unlock(&u->lock);
+    pthread_join(u->thread, NULL);
+    pthread_cond_destroy(&u->drained);
+    pthread_cond_destroy(&u->filled);
+    pthread_mutex_destroy(&u->lock);
+    bsonarena_untemp(u->arena, u->ring, RING_BYTES);
+    u->ring = NULL;
+}
@@ -0,0 +1,42 @@
+#ifndef _BSON_UNPACK_H_
+#define _BSON_UNPACK_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "allocator.h"
+
+#define UNPACK_SLOTS     4
+#define UNPACK_SLOTBYTES 65536
+
+/* Inflates a gzip or zlib file on its own thread into a bounded ring of
+ * buffers, while the parser drains the ring from the other end. The ring
+ * (and the compressed read buffer) is one arena temporary taken at start;
+ * zlib's own state goes through the allocator hooks. */
+typedef struct {
+    pthread_mutex_t  lock;
+    pthread_cond_t   filled;
+    pthread_cond_t   drained;
+    pthread_t        thread;
+    int              fd;
+    char            *ring;
+    uint64_t         lens[UNPACK_SLOTS];
+    uint64_t         head;   /* Next slot to drain */
+    uint64_t         tail;   /* Next slot to fill */
+    uint64_t         pos;    /* Drained so far from the head slot */
+    int              done;
+    int              failed; /* Corrupt or truncated stream, or no memory */
+    int              stop;
+    uint64_t         packed; /* Compressed bytes read */
+    bsonarena       *arena;
+} bsonunpack;
+
+/* Whether a file starting with these bytes is gzip or zlib */
+int      bson_unpack_detect(const unsigned char *head, uint64_t len);
+int      bson_unpack_start(bsonunpack *u, bsonarena *arena, int fd);
+/* Bytes copied into dst, 0 at the end, -1 when the stream was bad */
+ssize_t  bson_unpack_read(bsonunpack *u, char *dst, uint64_t max);
+void     bson_unpack_stop(bsonunpack *u);
+
+#endif
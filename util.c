@@ -4,37 +4,38 @@
 #include <string.h>
 #include <assert.h>
 #include <stdio.h>
-
-static uint32_t murmur32_scramble(uint32_t k) {
-    k *= 0xCC9E2D51;
-    k = (k << 15) | (k >> 17);
-    k *= 0x1B873593;
+#include <time.h>
+
+/* MurmurHash64A. Words are assembled little endian by hand so every host
+ * (and anything re-implementing this, like a compile time hasher) agrees. */
+static uint64_t murmur64_load(const uint8_t *p, uint64_t n) {
+    uint64_t k = 0;
+    while(n--)
+	k |= (uint64_t)(p[n]) << (n * 8);
     return k;
 }
 
-static uint32_t murmur32(const uint8_t *key, uint64_t len, uint32_t seed) {
-    uint32_t h = seed;
-    uint32_t k;
+static uint64_t murmur64(const uint8_t *key, uint64_t len, uint64_t seed) {
+    const uint64_t m = 0xC6A4A7935BD1E995ULL;
+    uint64_t h = seed ^ (len * m);
+    uint64_t k;
     uint64_t i;
-    for(i = len >> 2; i; i--) {
-	memcpy(&k, key, sizeof(uint32_t));
-	key += sizeof(uint32_t);
-	h ^= murmur32_scramble(k);
-	h = (h << 13) | (h >> 19);
-	h = h * 5 + 0xE6546B64;
+    for(i = len >> 3; i; i--) {
+	k = murmur64_load(key, 8);
+	key += 8;
+	k *= m;
+	k ^= k >> 47;
+	k *= m;
+	h ^= k;
+	h *= m;
     }
-    k = 0;
-    for(i = len & 3; i; i--) {
-	k <<= 8;
-	k |= key[i - 1];
+    if(len & 7) {
+	h ^= murmur64_load(key, len & 7);
+	h *= m;
     }
-    h ^= murmur32_scramble(k);
-    h ^= len;
-    h ^= h >> 16;
-    h *= 0x85EBCA6B;
-    h ^= h >> 13;
-    h *= 0xC2B2AE35;
-    h ^= h >> 16;
+    h ^= h >> 47;
+    h *= m;
+    h ^= h >> 47;
     return h;
 }
 
@@ -47,10 +48,20 @@ uint64_t bson_hash(const char *str) {
 	res = ((res << 5) + res) + c;
     return res;
 */
-    uint64_t res = (uint64_t)(murmur32((const uint8_t *)str, strlen(str), 199933));
+    uint64_t res = murmur64((const uint8_t *)str, strlen(str), 199933);
     return res;
 }
 
+uint64_t bson_hash_len(const char *str, uint64_t len) {
+    return murmur64((const uint8_t *)str, len, 199933);
+}
+
+uint64_t bson_nanos(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
 int bson_is_whitespace(char c) {
     return (
 	c ==  ' ' || c == '\n' ||
@@ -71,23 +82,6 @@ void bson_trim_string(char *dst, const char *src) {
     dst[i] = '\0';
 }
 
-void bson_free_inner_strings(void *data) {
-    char **strs = (char **)((size_t *)(data) + 1);
-    uint64_t len = *((size_t *)(data));
-
-    uint64_t i;
-    for(i = 0; i < len; i++) {
-	if(strs[i] != NULL)
-	    bsonfree(strs[i]);
-    }
-
-}
-
-
-
-
-
-
 /* End */
 
 
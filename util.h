@@ -4,8 +4,9 @@
 #include <stdint.h>
 
 uint64_t  bson_hash(const char *key);
+uint64_t  bson_hash_len(const char *key, uint64_t len);
+uint64_t  bson_nanos(void);
 int       bson_is_whitespace(char c);
 void      bson_trim_string(char *dst, const char *src);
-void      bson_free_inner_strings(void *data);
 
 #endif